@@ -2,6 +2,49 @@
 #include <vector>
 #include <string>
 #include <limits>
+#include <string_view>
+#include <charconv>
+#include <utility>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <deque>
+#include <random>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <new>
+#include <cmath>
+#include <chrono>
+#include <ctime>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define NOMINMAX
+#include <io.h>
+#include <windows.h>
+#endif
 using namespace std;
 
 // --------------------- Custom Stack ---------------------
@@ -12,24 +55,81 @@ private:
     int topIndex;
     int capacity;
 
+    void grow() {
+        int newCapacity = max(capacity * 2, 1); // a moved-from container has capacity 0
+        T* newArr = new T[newCapacity];
+        for (int i = 0; i <= topIndex; i++) newArr[i] = std::move(arr[i]);
+        delete[] arr;
+        arr = newArr;
+        capacity = newCapacity;
+    }
+
 public:
-    MyStack(int cap = 100) {
-        capacity = cap;
+    MyStack(int cap = 16) {
+        capacity = cap < 1 ? 1 : cap;
         arr = new T[capacity];
         topIndex = -1;
     }
 
-    void push(T dataItem) {
-        if (topIndex == capacity - 1) return;
+    MyStack(const MyStack& other) {
+        capacity = other.capacity;
+        arr = new T[capacity];
+        topIndex = other.topIndex;
+        for (int i = 0; i <= topIndex; i++) arr[i] = other.arr[i];
+    }
+
+    MyStack(MyStack&& other) noexcept {
+        arr = other.arr;
+        topIndex = other.topIndex;
+        capacity = other.capacity;
+        other.arr = NULL;
+        other.topIndex = -1;
+        other.capacity = 0;
+    }
+
+    MyStack& operator=(MyStack other) {
+        swap(arr, other.arr);
+        swap(topIndex, other.topIndex);
+        swap(capacity, other.capacity);
+        return *this;
+    }
+
+    // The item may be an element of this stack (push(top())), so it is taken
+    // out before grow() frees the old buffer.
+    void push(const T& dataItem) {
+        if (topIndex == capacity - 1) {
+            T item(dataItem);
+            grow();
+            arr[++topIndex] = std::move(item);
+            return;
+        }
         arr[++topIndex] = dataItem;
     }
 
+    void push(T&& dataItem) {
+        if (topIndex == capacity - 1) {
+            T item(std::move(dataItem));
+            grow();
+            arr[++topIndex] = std::move(item);
+            return;
+        }
+        arr[++topIndex] = std::move(dataItem);
+    }
+
+    // Slots always hold constructed elements, so the element is built first and
+    // then moved into its slot rather than constructed in place.
+    template <typename... Args>
+    T& emplace(Args&&... args) {
+        push(T(std::forward<Args>(args)...));
+        return arr[topIndex];
+    }
+
     void pop() {
         if (topIndex == -1) return;
         topIndex--;
     }
 
-    T top() {
+    T& top() {
         return arr[topIndex];
     }
 
@@ -37,6 +137,10 @@ public:
         return topIndex == -1;
     }
 
+    int size() {
+        return topIndex + 1;
+    }
+
     ~MyStack() {
         delete[] arr;
     }
@@ -52,20 +156,90 @@ private:
     int capacity;
     int count;
 
+    void grow() {
+        int newCapacity = max(capacity * 2, 1); // a moved-from container has capacity 0
+        T* newArr = new T[newCapacity];
+        for (int i = 0; i < count; i++) newArr[i] = std::move(arr[(frontIndex + i) % capacity]);
+        delete[] arr;
+        arr = newArr;
+        capacity = newCapacity;
+        frontIndex = 0;
+        rearIndex = count - 1;
+    }
+
+    template <typename U>
+    void place(U&& dataItem) {
+        rearIndex = (rearIndex + 1) % capacity;
+        arr[rearIndex] = std::forward<U>(dataItem);
+        count++;
+    }
+
 public:
-    MyQueue(int cap = 100) {
-        capacity = cap;
+    MyQueue(int cap = 16) {
+        capacity = cap < 1 ? 1 : cap;
         arr = new T[capacity];
         frontIndex = 0;
         rearIndex = -1;
         count = 0;
     }
 
-    void push(T dataItem) {
-        if (count == capacity) return;
-        rearIndex = (rearIndex + 1) % capacity;
-        arr[rearIndex] = dataItem;
-        count++;
+    MyQueue(const MyQueue& other) {
+        capacity = other.capacity;
+        arr = new T[capacity];
+        count = other.count;
+        frontIndex = 0;
+        rearIndex = count - 1;
+        for (int i = 0; i < count; i++) arr[i] = other.arr[(other.frontIndex + i) % other.capacity];
+    }
+
+    MyQueue(MyQueue&& other) noexcept {
+        arr = other.arr;
+        frontIndex = other.frontIndex;
+        rearIndex = other.rearIndex;
+        capacity = other.capacity;
+        count = other.count;
+        other.arr = NULL;
+        other.frontIndex = 0;
+        other.rearIndex = -1;
+        other.capacity = 0;
+        other.count = 0;
+    }
+
+    MyQueue& operator=(MyQueue other) {
+        swap(arr, other.arr);
+        swap(frontIndex, other.frontIndex);
+        swap(rearIndex, other.rearIndex);
+        swap(capacity, other.capacity);
+        swap(count, other.count);
+        return *this;
+    }
+
+    // As with MyStack, the item may be an element of this queue (push(front())).
+    void push(const T& dataItem) {
+        if (count == capacity) {
+            T item(dataItem);
+            grow();
+            place(std::move(item));
+            return;
+        }
+        place(dataItem);
+    }
+
+    void push(T&& dataItem) {
+        if (count == capacity) {
+            T item(std::move(dataItem));
+            grow();
+            place(std::move(item));
+            return;
+        }
+        place(std::move(dataItem));
+    }
+
+    // Built first and then moved into its slot, as in MyStack::emplace.
+    template <typename... Args>
+    T& emplace(Args&&... args) {
+        push(T(std::forward<Args>(args)...));
+        return arr[rearIndex];
     }
 
     void pop() {
@@ -74,317 +248,6587 @@ public:
         count--;
     }
 
-    T front() {
+    T& front() {
         return arr[frontIndex];
     }
 
+    // Element at a position counted from the front, for walking the queue in place.
+    T& at(int position) {
+        return arr[(frontIndex + position) % capacity];
+    }
+
     bool isEmpty() {
         return count == 0;
     }
 
+    int size() {
+        return count;
+    }
+
     ~MyQueue() {
         delete[] arr;
     }
 };
 
-// --------------------- Product Class ---------------------
-class Product {
+// --------------------- Concurrent Queue ---------------------
+// Bounded multi-producer/multi-consumer ring buffer (Vyukov's sequence-number
+// scheme). Each cell's sequence tells a producer or consumer whether it is that
+// thread's turn, so pushes and pops only contend on a single CAS. Unlike MyQueue it
+// does not grow: tryPush fails when the ring is full.
+template <typename T>
+class MyConcurrentQueue {
 private:
-    int id;
-    string name;
-    string category;
-    double price;
-    int stock;
+    struct Cell {
+        atomic<size_t> sequence;
+        T data;
+    };
+
+    Cell* cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePos;
+    alignas(64) atomic<size_t> dequeuePos;
 
 public:
-    Product(int productId, string productName, string productCategory, double productPrice, int productStock) {
-        id = productId;
-        name = productName;
-        category = productCategory;
-        price = productPrice;
-        stock = productStock;
+    MyConcurrentQueue(int cap = 1024) {
+        size_t size = 2;
+        while (size < (size_t)cap) size *= 2;
+        cells = new Cell[size];
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) cells[i].sequence.store(i, memory_order_relaxed);
+        enqueuePos.store(0, memory_order_relaxed);
+        dequeuePos.store(0, memory_order_relaxed);
     }
 
-    int getId() { return id; }
-    string getName() { return name; }
-    string getCategory() { return category; }
-    double getPrice() { return price; }
-    int getStock() { return stock; }
-    void setStock(int newStock) { stock = newStock; }
+    MyConcurrentQueue(const MyConcurrentQueue&) = delete;
+    MyConcurrentQueue& operator=(const MyConcurrentQueue&) = delete;
 
-    void display() {
-        cout << "ID: " << id
-             << " Name: " << name
-             << " Category: " << category
-             << " Price: $" << price
-             << " Stock: " << stock << endl;
+    template <typename U>
+    bool tryPush(U&& dataItem) {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(memory_order_acquire);
+            long long diff = (long long)seq - (long long)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+        cell->data = std::forward<U>(dataItem);
+        cell->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& out) {
+        return popBatch(&out, 1) == 1;
+    }
+
+    // Claims up to maxItems consecutive ready cells with one CAS and moves them
+    // into out. Returns how many were taken (0 if the queue is empty).
+    int popBatch(T* out, int maxItems) {
+        size_t pos = dequeuePos.load(memory_order_relaxed);
+        int ready;
+        while (true) {
+            ready = 0;
+            while (ready < maxItems) {
+                size_t seq = cells[(pos + ready) & mask].sequence.load(memory_order_acquire);
+                if (seq != pos + ready + 1) break;
+                ready++;
+            }
+            if (ready == 0) {
+                size_t seq = cells[pos & mask].sequence.load(memory_order_acquire);
+                if ((long long)seq - (long long)(pos + 1) < 0) return 0;
+                pos = dequeuePos.load(memory_order_relaxed);
+                continue;
+            }
+            if (dequeuePos.compare_exchange_weak(pos, pos + ready, memory_order_relaxed)) break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            Cell& cell = cells[(pos + i) & mask];
+            out[i] = std::move(cell.data);
+            cell.sequence.store(pos + i + mask + 1, memory_order_release);
+        }
+        return ready;
+    }
+
+    bool isEmpty() {
+        return dequeuePos.load(memory_order_acquire) == enqueuePos.load(memory_order_acquire);
+    }
+
+    ~MyConcurrentQueue() {
+        delete[] cells;
     }
 };
 
-// --------------------- CartItem Node ---------------------
-struct CartItem {
-    Product* product;
-    int quantity;
-    CartItem* next;
-    CartItem(Product* productItem, int quantityItem)
-        : product(productItem), quantity(quantityItem), next(NULL) {}
+// --------------------- Custom Hash Map ---------------------
+struct MyHash {
+    unsigned int operator()(int key) const {
+        unsigned long long h = (unsigned long long)(unsigned int)key * 0x9E3779B97F4A7C15ULL;
+        return (unsigned int)(h >> 32);
+    }
+
+    unsigned int operator()(string_view key) const {
+        unsigned int h = 2166136261u;
+        for (size_t i = 0; i < key.size(); i++) {
+            h ^= (unsigned char)key[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
 };
 
-// --------------------- Custom Linked List ---------------------
-class MyLinkedList {
+struct MyEqual {
+    template <typename A, typename B>
+    bool operator()(const A& a, const B& b) const { return a == b; }
+};
+
+// Open addressing with linear probing. A stored hash of 0 marks an empty slot,
+// and erase shifts the following run back so no tombstones are needed.
+// Nothing is allocated until the first insert.
+template <typename K, typename V, typename Hash = MyHash, typename Equal = MyEqual>
+class MyHashMap {
 private:
-    CartItem* head;
+    K* keys;
+    V* values;
+    unsigned int* hashes;
+    int capacity;
+    int minCapacity;
+    int count;
+
+    unsigned int hashOf(const K& key) const { return fixHash(Hash()(key)); }
+    static unsigned int fixHash(unsigned int h) { return h == 0 ? 1 : h; }
+
+    template <typename Q>
+    int findSlot(const Q& key) const {
+        if (capacity == 0) return -1;
+        unsigned int h = fixHash(Hash()(key));
+        int mask = capacity - 1;
+        int i = (int)(h & mask);
+        while (hashes[i] != 0) {
+            if (hashes[i] == h && Equal()(keys[i], key)) return i;
+            i = (i + 1) & mask;
+        }
+        return -1;
+    }
+
+    void allocate(int cap) {
+        capacity = cap;
+        keys = new K[capacity];
+        values = new V[capacity];
+        hashes = new unsigned int[capacity]();
+    }
+
+    void release() {
+        delete[] keys;
+        delete[] values;
+        delete[] hashes;
+    }
+
+    void grow() {
+        if (capacity == 0) {
+            allocate(minCapacity);
+            return;
+        }
+        K* oldKeys = keys;
+        V* oldValues = values;
+        unsigned int* oldHashes = hashes;
+        int oldCapacity = capacity;
+
+        allocate(capacity * 2);
+        int mask = capacity - 1;
+        for (int j = 0; j < oldCapacity; j++) {
+            if (oldHashes[j] == 0) continue;
+            int i = (int)(oldHashes[j] & mask);
+            while (hashes[i] != 0) i = (i + 1) & mask;
+            keys[i] = std::move(oldKeys[j]);
+            values[i] = std::move(oldValues[j]);
+            hashes[i] = oldHashes[j];
+        }
+
+        delete[] oldKeys;
+        delete[] oldValues;
+        delete[] oldHashes;
+    }
+
+public:
+    MyHashMap(int cap = 8) {
+        minCapacity = 16;
+        while (minCapacity < cap * 2) minCapacity *= 2;
+        keys = NULL;
+        values = NULL;
+        hashes = NULL;
+        capacity = 0;
+        count = 0;
+    }
+
+    MyHashMap(const MyHashMap& other) {
+        keys = NULL;
+        values = NULL;
+        hashes = NULL;
+        capacity = 0;
+        minCapacity = other.minCapacity;
+        count = other.count;
+        if (other.capacity > 0) allocate(other.capacity);
+        for (int i = 0; i < capacity; i++) {
+            if (other.hashes[i] == 0) continue;
+            keys[i] = other.keys[i];
+            values[i] = other.values[i];
+            hashes[i] = other.hashes[i];
+        }
+    }
+
+    MyHashMap& operator=(const MyHashMap& other) {
+        if (this != &other) {
+            MyHashMap copy(other);
+            swap(keys, copy.keys);
+            swap(values, copy.values);
+            swap(hashes, copy.hashes);
+            swap(capacity, copy.capacity);
+            swap(minCapacity, copy.minCapacity);
+            swap(count, copy.count);
+        }
+        return *this;
+    }
+
+    template <typename Q>
+    V* find(const Q& key) {
+        int i = findSlot(key);
+        return i == -1 ? NULL : &values[i];
+    }
+
+    // Inserts or overwrites. Returns false if the key was already present.
+    bool insert(const K& key, const V& value) {
+        if ((count + 1) * 2 > capacity) grow();
+        unsigned int h = hashOf(key);
+        int mask = capacity - 1;
+        int i = (int)(h & mask);
+        while (hashes[i] != 0) {
+            if (hashes[i] == h && Equal()(keys[i], key)) {
+                values[i] = value;
+                return false;
+            }
+            i = (i + 1) & mask;
+        }
+        keys[i] = key;
+        values[i] = value;
+        hashes[i] = h;
+        count++;
+        return true;
+    }
+
+    template <typename Q>
+    bool erase(const Q& key) {
+        int i = findSlot(key);
+        if (i == -1) return false;
+
+        int mask = capacity - 1;
+        int j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (hashes[j] == 0) break;
+            int home = (int)(hashes[j] & mask);
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (stays) continue;
+            keys[i] = std::move(keys[j]);
+            values[i] = std::move(values[j]);
+            hashes[i] = hashes[j];
+            i = j;
+        }
+        keys[i] = K();
+        values[i] = V();
+        hashes[i] = 0;
+        count--;
+        return true;
+    }
+
+    int size() const { return count; }
+
+    // Calls fn(key, value) for every entry, in no particular order.
+    template <typename Fn>
+    void forEach(Fn fn) {
+        for (int i = 0; i < capacity; i++) {
+            if (hashes[i] != 0) fn((const K&)keys[i], values[i]);
+        }
+    }
+
+    void reserve(int expected) {
+        int needed = minCapacity;
+        while (needed < expected * 2) needed *= 2;
+        if (capacity == 0) {
+            minCapacity = needed;
+            return;
+        }
+        while (capacity < needed) grow();
+    }
+
+    void clear() {
+        for (int i = 0; i < capacity; i++) {
+            if (hashes[i] == 0) continue;
+            keys[i] = K();
+            values[i] = V();
+            hashes[i] = 0;
+        }
+        count = 0;
+    }
+
+    ~MyHashMap() {
+        release();
+    }
+};
+
+// --------------------- Money ---------------------
+// Amounts are kept as integer cents so totals are exact.
+string formatMoney(long long cents) {
+    string sign = cents < 0 ? "-" : "";
+    unsigned long long magnitude = cents < 0 ? 0ULL - (unsigned long long)cents : (unsigned long long)cents;
+    string fraction = to_string(magnitude % 100);
+    if (fraction.size() < 2) fraction = "0" + fraction;
+    return sign + to_string(magnitude / 100) + "." + fraction;
+}
+
+// Parses "12", "12.5" or "12.34" (optionally signed) into cents. Anything else,
+// including a third decimal place, is rejected.
+bool parseCents(string_view text, long long& cents) {
+    while (!text.empty() && isspace((unsigned char)text.front())) text.remove_prefix(1);
+    while (!text.empty() && isspace((unsigned char)text.back())) text.remove_suffix(1);
+    bool negative = !text.empty() && text[0] == '-';
+    if (!text.empty() && (text[0] == '-' || text[0] == '+')) text.remove_prefix(1);
+
+    long long whole = 0;
+    int fraction = 0;
+    int fractionDigits = 0;
+    bool seenDigit = false;
+    bool seenPoint = false;
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '.' && !seenPoint) {
+            seenPoint = true;
+        } else if (isdigit((unsigned char)c)) {
+            seenDigit = true;
+            if (seenPoint) {
+                if (++fractionDigits > 2) return false;
+                fraction = fraction * 10 + (c - '0');
+            } else {
+                if (whole > numeric_limits<long long>::max() / 1000) return false;
+                whole = whole * 10 + (c - '0');
+            }
+        } else {
+            return false;
+        }
+    }
+    if (!seenDigit) return false;
+    if (fractionDigits == 1) fraction *= 10;
+    cents = whole * 100 + fraction;
+    if (negative) cents = -cents;
+    return true;
+}
+
+// --------------------- Output Buffer ---------------------
+enum RenderFormat {
+    RENDER_TEXT,
+    RENDER_JSON,
+    RENDER_CSV
+};
+
+// Collects formatted output in a reusable buffer and hands it to the stream in
+// large writes, instead of flushing a line at a time.
+class OutputBuffer {
+private:
+    static const size_t FLUSH_THRESHOLD = 64 * 1024;
+
+    ostream& out;
+    string buffer;
+
+    void reserveFor(size_t length) {
+        if (buffer.size() + length > FLUSH_THRESHOLD) flush();
+    }
+
+public:
+    OutputBuffer(ostream& target) : out(target) {
+        buffer.reserve(FLUSH_THRESHOLD + 256);
+    }
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    ~OutputBuffer() { flush(); }
+
+    OutputBuffer& put(string_view text) {
+        reserveFor(text.size());
+        buffer.append(text.data(), text.size());
+        return *this;
+    }
+
+    OutputBuffer& put(char c) {
+        reserveFor(1);
+        buffer.push_back(c);
+        return *this;
+    }
+
+    OutputBuffer& put(long long value) {
+        char digits[24];
+        to_chars_result result = to_chars(digits, digits + sizeof(digits), value);
+        return put(string_view(digits, result.ptr - digits));
+    }
+
+    OutputBuffer& put(int value) { return put((long long)value); }
+
+    // Cents as "1234.56".
+    OutputBuffer& putMoney(long long cents) {
+        if (cents < 0) {
+            put('-');
+            cents = -cents;
+        }
+        put(cents / 100);
+        char fraction[3] = {'.', (char)('0' + cents % 100 / 10), (char)('0' + cents % 10)};
+        return put(string_view(fraction, 3));
+    }
+
+    OutputBuffer& putJsonString(string_view text) {
+        put('"');
+        for (size_t i = 0; i < text.size(); i++) {
+            char c = text[i];
+            if (c == '"' || c == '\\') {
+                put('\\');
+                put(c);
+            } else if ((unsigned char)c < 0x20) {
+                const char* hex = "0123456789abcdef";
+                char escaped[6] = {'\\', 'u', '0', '0', hex[(c >> 4) & 0xF], hex[c & 0xF]};
+                put(string_view(escaped, 6));
+            } else {
+                put(c);
+            }
+        }
+        return put('"');
+    }
+
+    // Quotes the field only when it needs it, the way splitCsvLine reads it back.
+    OutputBuffer& putCsvField(string_view text) {
+        if (text.find_first_of(",\"\r\n") == string_view::npos) return put(text);
+        put('"');
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '"') put('"');
+            put(text[i]);
+        }
+        return put('"');
+    }
+
+    void flush() {
+        if (buffer.empty()) return;
+        out.write(buffer.data(), buffer.size());
+        out.flush();
+        buffer.clear();
+    }
+};
+
+// --------------------- Metrics ---------------------
+// Counters and latency histograms for the hot paths. Each thread records into
+// its own block (registered once, never freed) with plain relaxed stores, so an
+// event costs two clock reads and a few increments; readers sum the blocks.
+// Build with -DSHOP_NO_METRICS to compile every probe out.
+enum MetricId {
+    METRIC_CART_ADD,
+    METRIC_CART_REMOVE,
+    METRIC_CART_UNDO,
+    METRIC_CHECKOUT,
+    METRIC_LOGIN,
+    METRIC_COUNT
+};
+
+enum AllocationKind {
+    ALLOC_CART_ITEM,
+    ALLOC_CART_ITEM_BLOCK,
+    ALLOC_ORDER_LINES,
+    ALLOC_COUNT
+};
+
+const char* METRIC_NAMES[METRIC_COUNT] = {"cart_add", "cart_remove", "cart_undo", "checkout", "login"};
+const char* ALLOCATION_NAMES[ALLOC_COUNT] = {"cart_item", "cart_item_block", "order_lines"};
+
+// Log-linear buckets in the style of HdrHistogram: values below 16 ticks get a
+// bucket each; above that every power of two is split into 16 sub-buckets, so a
+// bucket is never wider than 1/16 of its lower bound.
+class LatencyBuckets {
+public:
+    static const int SUB_BUCKETS = 16;
+    static const int COUNT = 61 * SUB_BUCKETS;
+
+    static int highestBit(uint64_t value) {
+#if defined(__GNUC__)
+        return 63 - __builtin_clzll(value);
+#elif defined(_MSC_VER) && defined(_M_X64)
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return (int)index;
+#else
+        int bit = 0;
+        while (value >>= 1) bit++;
+        return bit;
+#endif
+    }
+
+    static int indexOf(uint64_t ticks) {
+        if (ticks < SUB_BUCKETS) return (int)ticks;
+        int exponent = highestBit(ticks);
+        return (exponent - 3) * SUB_BUCKETS + (int)((ticks >> (exponent - 4)) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t lowerBound(int index) {
+        if (index < SUB_BUCKETS) return index;
+        int exponent = index / SUB_BUCKETS + 3;
+        return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << (exponent - 4);
+    }
+
+    static uint64_t upperBound(int index) {
+        if (index < SUB_BUCKETS) return index + 1;
+        int exponent = index / SUB_BUCKETS + 3;
+        return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS + 1) << (exponent - 4);
+    }
+};
+
+// Fast monotonic ticks: the TSC on x86, steady_clock nanoseconds elsewhere.
+// ticksPerNanosecond() calibrates the TSC against steady_clock when reporting.
+class MetricClock {
+private:
+    inline static uint64_t startTicks = 0;
+    inline static chrono::steady_clock::time_point startTime;
+
+public:
+    static uint64_t now() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static void start() {
+        startTime = chrono::steady_clock::now();
+        startTicks = now();
+    }
+
+    static double ticksPerNanosecond() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+        if (startTicks == 0) start();
+        chrono::steady_clock::time_point begin = startTime;
+        if (chrono::steady_clock::now() - begin < chrono::milliseconds(10)) this_thread::sleep_for(chrono::milliseconds(10));
+        double elapsed = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count();
+        return elapsed > 0 ? (double)(now() - startTicks) / elapsed : 1.0;
+#else
+        return 1.0;
+#endif
+    }
+};
+
+struct MetricTotals {
+    uint64_t count[METRIC_COUNT];
+    uint64_t totalTicks[METRIC_COUNT];
+    uint64_t maxTicks[METRIC_COUNT];
+    uint64_t buckets[METRIC_COUNT][LatencyBuckets::COUNT];
+    uint64_t allocations[ALLOC_COUNT];
+};
+
+class MetricsRegistry {
+private:
+    struct ThreadBlock {
+        atomic<uint64_t> count[METRIC_COUNT];
+        atomic<uint64_t> totalTicks[METRIC_COUNT];
+        atomic<uint64_t> maxTicks[METRIC_COUNT];
+        atomic<uint64_t> buckets[METRIC_COUNT][LatencyBuckets::COUNT];
+        atomic<uint64_t> allocations[ALLOC_COUNT];
+    };
+
+    inline static mutex lock;
+    inline static vector<ThreadBlock*> blocks;
+
+    // Only the owning thread writes a block, so a relaxed load and store is
+    // enough and avoids a locked read-modify-write.
+    static void bump(atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+    static ThreadBlock& local() {
+        static thread_local ThreadBlock* block = NULL;
+        if (block == NULL) {
+            block = new ThreadBlock();
+            lock_guard<mutex> guard(lock);
+            blocks.push_back(block);
+        }
+        return *block;
+    }
+
+public:
+    static void record(MetricId metric, uint64_t ticks) {
+        ThreadBlock& block = local();
+        bump(block.count[metric], 1);
+        bump(block.totalTicks[metric], ticks);
+        if (ticks > block.maxTicks[metric].load(memory_order_relaxed)) block.maxTicks[metric].store(ticks, memory_order_relaxed);
+        bump(block.buckets[metric][LatencyBuckets::indexOf(ticks)], 1);
+    }
+
+    static void allocated(AllocationKind kind) { bump(local().allocations[kind], 1); }
+
+    static void collect(MetricTotals& totals) {
+        memset(&totals, 0, sizeof(totals));
+        lock_guard<mutex> guard(lock);
+        for (size_t b = 0; b < blocks.size(); b++) {
+            ThreadBlock& block = *blocks[b];
+            for (int m = 0; m < METRIC_COUNT; m++) {
+                totals.count[m] += block.count[m].load(memory_order_relaxed);
+                totals.totalTicks[m] += block.totalTicks[m].load(memory_order_relaxed);
+                totals.maxTicks[m] = max(totals.maxTicks[m], block.maxTicks[m].load(memory_order_relaxed));
+                for (int i = 0; i < LatencyBuckets::COUNT; i++) totals.buckets[m][i] += block.buckets[m][i].load(memory_order_relaxed);
+            }
+            for (int a = 0; a < ALLOC_COUNT; a++) totals.allocations[a] += block.allocations[a].load(memory_order_relaxed);
+        }
+    }
+};
+
+class MetricTimer {
+private:
+    MetricId metric;
+    uint64_t started;
+
+public:
+    MetricTimer(MetricId id) : metric(id), started(MetricClock::now()) {}
+    ~MetricTimer() { MetricsRegistry::record(metric, MetricClock::now() - started); }
+};
+
+#ifndef SHOP_NO_METRICS
+#define METRIC_CONCAT_INNER(a, b) a##b
+#define METRIC_CONCAT(a, b) METRIC_CONCAT_INNER(a, b)
+#define METRIC_TIME(metric) MetricTimer METRIC_CONCAT(metricTimer, __LINE__)(metric)
+#define METRIC_ALLOCATION(kind) MetricsRegistry::allocated(kind)
+#else
+#define METRIC_TIME(metric) ((void)0)
+#define METRIC_ALLOCATION(kind) ((void)0)
+#endif
+
+// Latency (in nanoseconds) below which the given fraction of events fell.
+double metricPercentile(MetricTotals& totals, int metric, double fraction, double ticksPerNs) {
+    uint64_t target = (uint64_t)ceil(totals.count[metric] * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < LatencyBuckets::COUNT; i++) {
+        seen += totals.buckets[metric][i];
+        if (seen >= target && seen > 0) {
+            uint64_t upper = min(LatencyBuckets::upperBound(i), totals.maxTicks[metric] + 1);
+            return (LatencyBuckets::lowerBound(i) + upper) / 2.0 / ticksPerNs;
+        }
+    }
+    return 0;
+}
+
+const char* METRICS_PROMETHEUS_PATH = "metrics.prom";
+const char* METRICS_JSON_PATH = "metrics.json";
+
+// Text is a summary table; JSON has counts, mean/percentiles in ns and allocations.
+void renderMetrics(OutputBuffer& out, RenderFormat format) {
+    MetricTotals* totals = new MetricTotals();
+    MetricsRegistry::collect(*totals);
+    double ticksPerNs = MetricClock::ticksPerNanosecond();
+    char number[32];
+
+    if (format == RENDER_JSON) out.put("{\"operations\":{");
+    else out.put("operation        count    mean ns     p50 ns     p99 ns     max ns\n");
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        uint64_t count = totals->count[m];
+        double mean = count == 0 ? 0 : totals->totalTicks[m] / (double)count / ticksPerNs;
+        double p50 = metricPercentile(*totals, m, 0.50, ticksPerNs);
+        double p99 = metricPercentile(*totals, m, 0.99, ticksPerNs);
+        double maximum = totals->maxTicks[m] / ticksPerNs;
+        if (format == RENDER_JSON) {
+            if (m > 0) out.put(',');
+            out.put('"').put(METRIC_NAMES[m]).put("\":{\"count\":").put((long long)count);
+            snprintf(number, sizeof(number), "%.1f", mean);
+            out.put(",\"meanNs\":").put(number);
+            snprintf(number, sizeof(number), "%.1f", p50);
+            out.put(",\"p50Ns\":").put(number);
+            snprintf(number, sizeof(number), "%.1f", p99);
+            out.put(",\"p99Ns\":").put(number);
+            snprintf(number, sizeof(number), "%.1f", maximum);
+            out.put(",\"maxNs\":").put(number).put('}');
+        } else {
+            char row[128];
+            snprintf(row, sizeof(row), "%-12s %9llu %10.0f %10.0f %10.0f %10.0f\n",
+                     METRIC_NAMES[m], (unsigned long long)count, mean, p50, p99, maximum);
+            out.put(row);
+        }
+    }
+    if (format == RENDER_JSON) out.put("},\"allocations\":{");
+    else out.put("allocations:");
+    for (int a = 0; a < ALLOC_COUNT; a++) {
+        if (format == RENDER_JSON) {
+            if (a > 0) out.put(',');
+            out.put('"').put(ALLOCATION_NAMES[a]).put("\":").put((long long)totals->allocations[a]);
+        } else {
+            out.put(' ').put(ALLOCATION_NAMES[a]).put('=').put((long long)totals->allocations[a]);
+        }
+    }
+    out.put(format == RENDER_JSON ? "}}\n" : "\n");
+    delete totals;
+}
+
+// Prometheus text exposition format, latencies as histograms in seconds.
+void renderMetricsPrometheus(OutputBuffer& out) {
+    MetricTotals* totals = new MetricTotals();
+    MetricsRegistry::collect(*totals);
+    double ticksPerSecond = MetricClock::ticksPerNanosecond() * 1e9;
+    char number[32];
+
+    out.put("# HELP shop_operation_seconds Latency of store operations.\n");
+    out.put("# TYPE shop_operation_seconds histogram\n");
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        uint64_t cumulative = 0;
+        for (int i = 0; i < LatencyBuckets::COUNT; i++) {
+            if (totals->buckets[m][i] == 0) continue;
+            cumulative += totals->buckets[m][i];
+            snprintf(number, sizeof(number), "%.9g", LatencyBuckets::upperBound(i) / ticksPerSecond);
+            out.put("shop_operation_seconds_bucket{operation=\"").put(METRIC_NAMES[m])
+               .put("\",le=\"").put(number).put("\"} ").put((long long)cumulative).put('\n');
+        }
+        out.put("shop_operation_seconds_bucket{operation=\"").put(METRIC_NAMES[m])
+           .put("\",le=\"+Inf\"} ").put((long long)totals->count[m]).put('\n');
+        snprintf(number, sizeof(number), "%.9g", totals->totalTicks[m] / ticksPerSecond);
+        out.put("shop_operation_seconds_sum{operation=\"").put(METRIC_NAMES[m]).put("\"} ").put(number).put('\n');
+        out.put("shop_operation_seconds_count{operation=\"").put(METRIC_NAMES[m])
+           .put("\"} ").put((long long)totals->count[m]).put('\n');
+    }
+    out.put("# HELP shop_allocations_total Objects allocated on hot paths.\n");
+    out.put("# TYPE shop_allocations_total counter\n");
+    for (int a = 0; a < ALLOC_COUNT; a++) {
+        out.put("shop_allocations_total{kind=\"").put(ALLOCATION_NAMES[a]).put("\"} ")
+           .put((long long)totals->allocations[a]).put('\n');
+    }
+    delete totals;
+}
+
+// --------------------- Product Class ---------------------
+// A product does not own its name and category text. Products held by a Catalog
+// point into the catalog's string storage; a free-standing Product (for example
+// one about to be passed to Catalog::add) points at whatever the caller built
+// it from, which must outlive it.
+class Product {
+    friend class Catalog;
+
+private:
+    // id and stock share one 8-byte word, keeping Product at 48 bytes so a
+    // ProductSlot fits in one cache line.
+    int id;
+    atomic<int> stock;
+    string_view name;
+    string_view category;
+    long long priceCents;
+
+public:
+    // Bumped whenever a price changes or a product is removed, so anything caching
+    // a total knows to recompute it.
+    inline static atomic<unsigned long long> priceEpoch{0};
+
+    Product() {
+        id = 0;
+        priceCents = 0;
+        stock = 0;
+    }
+
+    Product(int productId, string_view productName, string_view productCategory, long long productPriceCents, int productStock) {
+        id = productId;
+        name = productName;
+        category = productCategory;
+        priceCents = productPriceCents;
+        stock = productStock;
+    }
+
+    Product(const Product& other) {
+        id = other.id;
+        name = other.name;
+        category = other.category;
+        priceCents = other.priceCents;
+        stock = other.stock.load();
+    }
+
+    Product& operator=(const Product& other) {
+        id = other.id;
+        name = other.name;
+        category = other.category;
+        priceCents = other.priceCents;
+        stock = other.stock.load();
+        return *this;
+    }
+
+    int getId() { return id; }
+    string_view getName() { return name; }
+    string_view getCategory() { return category; }
+    long long getPriceCents() { return priceCents; }
+
+    void setPriceCents(long long newPriceCents) {
+        priceCents = newPriceCents;
+        priceEpoch++;
+    }
+    int getStock() { return stock.load(memory_order_relaxed); }
+    void setStock(int newStock) { stock.store(newStock); }
+
+    // Takes quantity units out of stock only if that many are available.
+    bool reserveStock(int quantity) {
+        if (quantity <= 0) return false;
+        int current = stock.load(memory_order_relaxed);
+        while (current >= quantity) {
+            if (stock.compare_exchange_weak(current, current - quantity, memory_order_acq_rel)) return true;
+        }
+        return false;
+    }
+
+    void releaseStock(int quantity) { stock.fetch_add(quantity, memory_order_acq_rel); }
+
+    void render(OutputBuffer& out, RenderFormat format) {
+        if (format == RENDER_JSON) {
+            out.put("{\"id\":").put(id)
+               .put(",\"name\":").putJsonString(name)
+               .put(",\"category\":").putJsonString(category)
+               .put(",\"price\":").putMoney(priceCents)
+               .put(",\"stock\":").put(getStock()).put('}');
+        } else if (format == RENDER_CSV) {
+            out.put(id).put(',').putCsvField(name).put(',').putCsvField(category)
+               .put(',').putMoney(priceCents).put(',').put(getStock()).put('\n');
+        } else {
+            out.put("ID: ").put(id)
+               .put(" Name: ").put(name)
+               .put(" Category: ").put(category)
+               .put(" Price: $").putMoney(priceCents)
+               .put(" Stock: ").put(getStock()).put('\n');
+        }
+    }
+};
+
+// --------------------- Product Handle ---------------------
+// Products live in fixed blocks that are never moved, so a slot address stays valid
+// for the life of the catalog. Removing a product bumps the slot's generation, which
+// makes every handle taken before the removal resolve to NULL. Slots are cache-line
+// aligned so concurrent stock updates on neighbouring products don't false-share.
+struct alignas(64) ProductSlot {
+    Product product;
+    int generation;
+    int nextFree;
+    bool inUse;
+
+    ProductSlot() : generation(0), nextFree(-1), inUse(false) {}
+};
+
+static_assert(sizeof(ProductSlot) == 64, "a product slot should take exactly one cache line");
+
+struct ProductHandle {
+    ProductSlot* slot;
+    int generation;
+
+    ProductHandle() : slot(NULL), generation(0) {}
+    ProductHandle(ProductSlot* productSlot, int slotGeneration)
+        : slot(productSlot), generation(slotGeneration) {}
+
+    Product* get() const {
+        if (slot == NULL || slot->generation != generation) return NULL;
+        return &slot->product;
+    }
+
+    bool operator==(const ProductHandle& other) const {
+        return slot == other.slot && generation == other.generation;
+    }
+};
+
+struct ProductHandleHash {
+    unsigned int operator()(const ProductHandle& handle) const {
+        unsigned long long h = ((unsigned long long)(size_t)handle.slot ^ (unsigned int)handle.generation)
+                               * 0x9E3779B97F4A7C15ULL;
+        return (unsigned int)(h >> 32);
+    }
+};
+
+// --------------------- String Arena ---------------------
+// Append-only storage for many small strings, carved out of 64 KiB blocks.
+// Stored text never moves, so the returned views stay valid until the arena is
+// destroyed; nothing is freed individually.
+class StringArena {
+private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    vector<char*> blocks;
+    size_t used;
+    size_t bytesStored;
+
+public:
+    StringArena() {
+        used = BLOCK_SIZE;
+        bytesStored = 0;
+    }
+
+    StringArena(const StringArena&) = delete;
+    StringArena& operator=(const StringArena&) = delete;
+
+    string_view store(string_view text) {
+        if (text.empty()) return string_view();
+        bytesStored += text.size();
+        if (text.size() > BLOCK_SIZE / 4) {
+            // Big strings get a block of their own, kept behind the current one.
+            char* own = new char[text.size()];
+            memcpy(own, text.data(), text.size());
+            blocks.insert(blocks.empty() ? blocks.end() : blocks.end() - 1, own);
+            return string_view(own, text.size());
+        }
+        if (BLOCK_SIZE - used < text.size()) {
+            blocks.push_back(new char[BLOCK_SIZE]);
+            used = 0;
+        }
+        char* start = blocks.back() + used;
+        memcpy(start, text.data(), text.size());
+        used += text.size();
+        return string_view(start, text.size());
+    }
+
+    size_t size() { return bytesStored; }
+
+    ~StringArena() {
+        for (size_t i = 0; i < blocks.size(); i++) delete[] blocks[i];
+    }
+};
+
+// --------------------- Category Dictionary ---------------------
+// Maps each distinct category string to a small integer code. The interned text
+// lives in an arena, so nameOf() views stay valid for the dictionary's lifetime.
+class CategoryDictionary {
+private:
+    StringArena text;
+    vector<string_view> names;
+    MyHashMap<string_view, int> codeByName;
+
+public:
+    int intern(string_view name) {
+        int* code = codeByName.find(name);
+        if (code != NULL) return *code;
+        int newCode = (int)names.size();
+        names.push_back(text.store(name));
+        codeByName.insert(names.back(), newCode);
+        return newCode;
+    }
+
+    // Returns -1 for a category that has never been seen.
+    int find(string_view name) {
+        int* code = codeByName.find(name);
+        return code == NULL ? -1 : *code;
+    }
+
+    string_view nameOf(int code) { return names[code]; }
+    int size() { return (int)names.size(); }
+};
+
+// --------------------- Search Index ---------------------
+// Inverted index over product names and categories. Each indexed product gets a
+// document number that is never reused, so postings only ever grow at the end and
+// are stored delta + varint encoded (the low bit of each entry marks a name hit).
+// Removed products are not deleted from the postings; their handles go stale and
+// are skipped, and the owner rebuilds the index once most documents are dead.
+// Terms live in a prefix trie whose nodes remember their most frequent completions,
+// so typeahead only walks the prefix.
+class ProductSearchIndex {
+private:
+    static const int SUGGESTIONS_PER_NODE = 8;
+
+    struct PostingList {
+        vector<unsigned char> bytes;
+        int lastDocument;
+        int count;
+
+        PostingList() : lastDocument(-1), count(0) {}
+
+        void append(int document, bool inName) {
+            unsigned int value = ((unsigned int)(document - lastDocument) << 1) | (inName ? 1u : 0u);
+            while (value >= 0x80) {
+                bytes.push_back((unsigned char)(value | 0x80));
+                value >>= 7;
+            }
+            bytes.push_back((unsigned char)value);
+            lastDocument = document;
+            count++;
+        }
+    };
+
+    struct PostingCursor {
+        const PostingList* list;
+        size_t offset;
+        int document;
+        bool inName;
+
+        PostingCursor(const PostingList* postingList) : list(postingList), offset(0), document(-1), inName(false) {}
+
+        bool next() {
+            if (offset >= list->bytes.size()) {
+                document = numeric_limits<int>::max();
+                return false;
+            }
+            unsigned int value = 0;
+            int shift = 0;
+            while (true) {
+                unsigned char byte = list->bytes[offset++];
+                value |= (unsigned int)(byte & 0x7F) << shift;
+                if (byte < 0x80) break;
+                shift += 7;
+            }
+            document += (int)(value >> 1);
+            inName = (value & 1) != 0;
+            return true;
+        }
+
+        bool advanceTo(int target) {
+            while (document < target) {
+                if (!next()) return false;
+            }
+            return true;
+        }
+    };
+
+    struct TrieNode {
+        vector<pair<char, int>> children;
+        int termId;
+        int suggestions[SUGGESTIONS_PER_NODE];
+        int suggestionCount;
+
+        TrieNode() : termId(-1), suggestions(), suggestionCount(0) {}
+    };
+
+    vector<TrieNode> nodes;
+    vector<string> terms;
+    vector<PostingList> postings;
+    vector<ProductHandle> documents;
+    int deadDocuments;
+
+    static void tokenize(string_view text, vector<string>& out) {
+        string token;
+        for (size_t i = 0; i <= text.size(); i++) {
+            if (i < text.size() && isalnum((unsigned char)text[i])) {
+                token += (char)tolower((unsigned char)text[i]);
+            } else if (!token.empty()) {
+                out.push_back(token);
+                token.clear();
+            }
+        }
+    }
+
+    int child(int node, char c) {
+        vector<pair<char, int>>& children = nodes[node].children;
+        vector<pair<char, int>>::iterator it = lower_bound(children.begin(), children.end(), make_pair(c, -1));
+        return (it != children.end() && it->first == c) ? it->second : -1;
+    }
+
+    int findNode(string_view prefix) {
+        int node = 0;
+        for (size_t i = 0; i < prefix.size() && node != -1; i++) node = child(node, prefix[i]);
+        return node;
+    }
+
+    int termFor(const string& term) {
+        int node = 0;
+        for (size_t i = 0; i < term.size(); i++) {
+            int next = child(node, term[i]);
+            if (next == -1) {
+                next = (int)nodes.size();
+                nodes.push_back(TrieNode());
+                vector<pair<char, int>>& children = nodes[node].children;
+                children.insert(lower_bound(children.begin(), children.end(), make_pair(term[i], -1)),
+                                make_pair(term[i], next));
+            }
+            node = next;
+        }
+        if (nodes[node].termId == -1) {
+            nodes[node].termId = (int)terms.size();
+            terms.push_back(term);
+            postings.push_back(PostingList());
+        }
+        return nodes[node].termId;
+    }
+
+    // Keeps each node on the term's path listing its most frequent completions.
+    void promote(int termId) {
+        const string& term = terms[termId];
+        int frequency = postings[termId].count;
+        int node = 0;
+        for (size_t depth = 0; depth <= term.size(); depth++) {
+            TrieNode& current = nodes[node];
+            int position = -1;
+            for (int i = 0; i < current.suggestionCount; i++) {
+                if (current.suggestions[i] == termId) position = i;
+            }
+            if (position == -1) {
+                if (current.suggestionCount < SUGGESTIONS_PER_NODE) {
+                    position = current.suggestionCount++;
+                } else if (postings[current.suggestions[SUGGESTIONS_PER_NODE - 1]].count < frequency) {
+                    position = SUGGESTIONS_PER_NODE - 1;
+                }
+                if (position != -1) current.suggestions[position] = termId;
+            }
+            while (position > 0 && postings[current.suggestions[position - 1]].count < frequency) {
+                swap(current.suggestions[position], current.suggestions[position - 1]);
+                position--;
+            }
+            if (depth < term.size()) node = child(node, term[depth]);
+        }
+    }
+
+    vector<ProductHandle> rankResults(vector<pair<double, int>>& scored, int limit) {
+        size_t keep = scored.size();
+        if (limit > 0 && (size_t)limit < keep) keep = limit;
+        partial_sort(scored.begin(), scored.begin() + keep, scored.end());
+
+        vector<ProductHandle> results;
+        for (size_t i = 0; i < keep; i++) results.push_back(documents[scored[i].second]);
+        return results;
+    }
+
+public:
+    ProductSearchIndex() {
+        clear();
+    }
+
+    void clear() {
+        nodes.assign(1, TrieNode());
+        terms.clear();
+        postings.clear();
+        documents.clear();
+        deadDocuments = 0;
+    }
+
+    void addProduct(ProductHandle handle, string_view name, string_view category) {
+        vector<string> nameTokens, categoryTokens;
+        tokenize(name, nameTokens);
+        tokenize(category, categoryTokens);
+
+        vector<pair<int, bool>> hits;
+        for (size_t i = 0; i < nameTokens.size(); i++) hits.push_back(make_pair(termFor(nameTokens[i]), true));
+        for (size_t i = 0; i < categoryTokens.size(); i++) hits.push_back(make_pair(termFor(categoryTokens[i]), false));
+        sort(hits.begin(), hits.end(), [](const pair<int, bool>& a, const pair<int, bool>& b) {
+            return a.first != b.first ? a.first < b.first : a.second > b.second;
+        });
+
+        int document = (int)documents.size();
+        documents.push_back(handle);
+        for (size_t i = 0; i < hits.size(); i++) {
+            if (i > 0 && hits[i].first == hits[i - 1].first) continue;
+            postings[hits[i].first].append(document, hits[i].second);
+            promote(hits[i].first);
+        }
+    }
+
+    void productRemoved() { deadDocuments++; }
+
+    bool needsCompaction() {
+        return deadDocuments > 1024 && deadDocuments * 2 > (int)documents.size();
+    }
+
+    // Products containing every query term, best first. A name hit scores twice a
+    // category hit, weighted by how rare the term is.
+    vector<ProductHandle> search(string_view query, int limit) {
+        vector<ProductHandle> results;
+        vector<string> queryTerms;
+        tokenize(query, queryTerms);
+        if (queryTerms.empty()) return results;
+
+        vector<int> termIds;
+        for (size_t i = 0; i < queryTerms.size(); i++) {
+            int node = findNode(queryTerms[i]);
+            if (node == -1 || nodes[node].termId == -1) return results;
+            termIds.push_back(nodes[node].termId);
+        }
+        sort(termIds.begin(), termIds.end());
+        termIds.erase(unique(termIds.begin(), termIds.end()), termIds.end());
+        sort(termIds.begin(), termIds.end(), [this](int a, int b) { return postings[a].count < postings[b].count; });
+
+        vector<PostingCursor> cursors;
+        vector<double> weights;
+        for (size_t i = 0; i < termIds.size(); i++) {
+            cursors.push_back(PostingCursor(&postings[termIds[i]]));
+            weights.push_back(log(1.0 + (double)documents.size() / postings[termIds[i]].count));
+        }
+
+        vector<pair<double, int>> scored;
+        while (cursors[0].next()) {
+            int document = cursors[0].document;
+            bool all = true;
+            for (size_t i = 1; i < cursors.size() && all; i++) {
+                if (!cursors[i].advanceTo(document)) return rankResults(scored, limit);
+                all = cursors[i].document == document;
+            }
+            if (!all || documents[document].get() == NULL) continue;
+
+            double score = 0;
+            for (size_t i = 0; i < cursors.size(); i++) score += weights[i] * (cursors[i].inName ? 2 : 1);
+            scored.push_back(make_pair(-score, document));
+        }
+        return rankResults(scored, limit);
+    }
+
+    // Most frequent indexed terms starting with prefix.
+    vector<string> suggest(string_view prefix, int limit) {
+        vector<string> completions;
+        string lowered;
+        for (size_t i = 0; i < prefix.size(); i++) lowered += (char)tolower((unsigned char)prefix[i]);
+        int node = findNode(lowered);
+        if (node == -1) return completions;
+        for (int i = 0; i < nodes[node].suggestionCount && (int)completions.size() < limit; i++) {
+            completions.push_back(terms[nodes[node].suggestions[i]]);
+        }
+        return completions;
+    }
+};
+
+// --------------------- Catalog Class ---------------------
+// Owns the products in a slab of slots and keeps an id -> slot index.
+// Add and remove are O(1) and never move a live product.
+// Alongside the slab it keeps structure-of-arrays columns indexed by slot number
+// (category code, price in cents) so queries can scan them without touching the
+// product records; an unused slot has category code -1. The full-text search index
+// is built on first use and then kept up to date by add() and remove().
+// Product names are copied into a string arena and categories are interned, so
+// the stored products' views point at memory the catalog owns. A removed
+// product's name stays in the arena until the catalog is destroyed. Products
+// loaded from a catalog file instead keep viewing their names in the file's
+// mapping, which the catalog then holds open for its lifetime.
+class CatalogFile;
+
+class Catalog {
+private:
+    static const int BLOCK_SIZE = 1024;
+
+    vector<ProductSlot*> blocks;
+    MyHashMap<int, int> slotById;
+    int slotCount;
+    int freeHead;
+    int liveCount;
+    CategoryDictionary categories;
+    StringArena names;
+    vector<int32_t> categoryCodes;
+    vector<int32_t> priceCents;
+    ProductSearchIndex searchIndex;
+    bool searchIndexBuilt;
+    vector<CatalogFile*> sourceFiles;
+
+    static int32_t columnPrice(long long cents) {
+        if (cents < 0) return 0;
+        if (cents > numeric_limits<int32_t>::max() - 1) return numeric_limits<int32_t>::max() - 1;
+        return (int32_t)cents;
+    }
+
+    ProductSlot& slot(int index) { return blocks[index / BLOCK_SIZE][index % BLOCK_SIZE]; }
+
+    int allocateSlot() {
+        if (freeHead != -1) {
+            int index = freeHead;
+            freeHead = slot(index).nextFree;
+            return index;
+        }
+        if (slotCount == (int)blocks.size() * BLOCK_SIZE) blocks.push_back(new ProductSlot[BLOCK_SIZE]);
+        return slotCount++;
+    }
+
+    ProductHandle insert(Product& product, bool copyName) {
+        if (slotById.find(product.getId()) != NULL) return ProductHandle();
+
+        int index = allocateSlot();
+        ProductSlot& added = slot(index);
+        added.product = product;
+        int categoryCode = categories.intern(product.getCategory());
+        if (copyName) added.product.name = names.store(product.getName());
+        added.product.category = categories.nameOf(categoryCode);
+        added.inUse = true;
+        added.nextFree = -1;
+        slotById.insert(product.getId(), index);
+        liveCount++;
+
+        if (index == (int)categoryCodes.size()) {
+            categoryCodes.push_back(-1);
+            priceCents.push_back(0);
+        }
+        categoryCodes[index] = categoryCode;
+        priceCents[index] = columnPrice(product.getPriceCents());
+
+        ProductHandle handle(&added, added.generation);
+        if (searchIndexBuilt) searchIndex.addProduct(handle, added.product.getName(), added.product.getCategory());
+        return handle;
+    }
+
+public:
+    Catalog() {
+        slotCount = 0;
+        freeHead = -1;
+        liveCount = 0;
+        searchIndexBuilt = false;
+    }
+
+    Catalog(const Catalog&) = delete;
+    Catalog& operator=(const Catalog&) = delete;
+
+    // Keeps text for as long as the catalog lives; order history uses it for the
+    // names of products removed since.
+    string_view storeName(string_view text) { return names.store(text); }
+
+    ProductHandle find(int productId) {
+        int* index = slotById.find(productId);
+        if (index == NULL) return ProductHandle();
+        ProductSlot& found = slot(*index);
+        return ProductHandle(&found, found.generation);
+    }
+
+    // Returns a null handle if the id is already in the catalog.
+    ProductHandle add(Product product) { return insert(product, true); }
+
+    // Like add(), but keeps the product's name view instead of copying the text.
+    // Only for names inside a file the catalog has adopted.
+    ProductHandle addInPlace(Product product) { return insert(product, false); }
+
+    // Takes ownership of a catalog file whose text addInPlace() products view.
+    void adoptFile(CatalogFile* file) { sourceFiles.push_back(file); }
+
+
+    bool remove(int productId) {
+        int* index = slotById.find(productId);
+        if (index == NULL) return false;
+
+        int freed = *index;
+        ProductSlot& removed = slot(freed);
+        removed.product = Product();
+        removed.inUse = false;
+        removed.generation++;
+        removed.nextFree = freeHead;
+        freeHead = freed;
+        slotById.erase(productId);
+        liveCount--;
+        categoryCodes[freed] = -1;
+        priceCents[freed] = 0;
+        Product::priceEpoch++;
+        if (searchIndexBuilt) searchIndex.productRemoved();
+        return true;
+    }
+
+    int size() { return liveCount; }
+
+    bool setPrice(int productId, long long newPriceCents) {
+        int* index = slotById.find(productId);
+        if (index == NULL) return false;
+        slot(*index).product.setPriceCents(newPriceCents);
+        priceCents[*index] = columnPrice(newPriceCents);
+        return true;
+    }
+
+    void reserve(int expected) {
+        slotById.reserve(expected);
+        blocks.reserve(expected / BLOCK_SIZE + 1);
+        categoryCodes.reserve(expected);
+        priceCents.reserve(expected);
+    }
+
+    CategoryDictionary& getCategories() { return categories; }
+
+    ProductSearchIndex& getSearchIndex() {
+        if (!searchIndexBuilt || searchIndex.needsCompaction()) {
+            searchIndex.clear();
+            for (int i = 0; i < slotCount; i++) {
+                ProductSlot& current = slot(i);
+                if (!current.inUse) continue;
+                searchIndex.addProduct(ProductHandle(&current, current.generation),
+                                       current.product.getName(), current.product.getCategory());
+            }
+            searchIndexBuilt = true;
+        }
+        return searchIndex;
+    }
+    const int32_t* categoryColumn() { return categoryCodes.data(); }
+    const int32_t* priceColumn() { return priceCents.data(); }
+
+    // Slots are numbered 0..slotLimit()-1; unused ones return NULL.
+    int slotLimit() { return slotCount; }
+    Product* productAt(int index) {
+        ProductSlot& found = slot(index);
+        return found.inUse ? &found.product : NULL;
+    }
+
+    // JSON output is one array; CSV output has the header importCatalogCsv expects.
+    void render(OutputBuffer& out, RenderFormat format) {
+        if (format == RENDER_JSON) out.put('[');
+        if (format == RENDER_CSV) out.put("id,name,category,price,stock\n");
+        bool first = true;
+        for (int i = 0; i < slotCount; i++) {
+            Product* product = productAt(i);
+            if (product == NULL) continue;
+            if (format == RENDER_JSON && !first) out.put(',');
+            product->render(out, format);
+            first = false;
+        }
+        if (format == RENDER_JSON) out.put("]\n");
+    }
+
+    void display() {
+        OutputBuffer out(cout);
+        render(out, RENDER_TEXT);
+    }
+
+    ~Catalog();
+};
+
+// --------------------- Product Query ---------------------
+// Filters the catalog's structure-of-arrays columns by category and price range,
+// then checks stock on the survivors and returns the cheapest `limit` products.
+// The predicate runs 8 (AVX2) or 4 (SSE2) slots per instruction where available.
+struct ProductQuery {
+    string category;        // empty = any category
+    long long minPriceCents;
+    long long maxPriceCents;
+    bool inStockOnly;
+    int limit;              // 0 = no limit
+
+    ProductQuery() : minPriceCents(0), maxPriceCents(numeric_limits<int32_t>::max()), inStockOnly(false), limit(0) {}
+};
+
+// Appends the slot numbers whose code matches (any live slot when code < 0) and
+// whose price lies in [low, high]. Returns how many were appended.
+int filterProductColumns(const int32_t* codes, const int32_t* prices, int count,
+                         int32_t code, int32_t low, int32_t high, int32_t* out) {
+    int found = 0;
+    int i = 0;
+    bool anyCategory = code < 0;
+    int32_t below = low - 1;
+    int32_t above = high + 1;
+
+#if defined(__AVX2__)
+    __m256i wantCode = _mm256_set1_epi32(anyCategory ? -1 : code);
+    __m256i lowBound = _mm256_set1_epi32(below);
+    __m256i highBound = _mm256_set1_epi32(above);
+    for (; i + 8 <= count; i += 8) {
+        __m256i slotCodes = _mm256_loadu_si256((const __m256i*)(codes + i));
+        __m256i slotPrices = _mm256_loadu_si256((const __m256i*)(prices + i));
+        __m256i match = anyCategory ? _mm256_cmpgt_epi32(slotCodes, wantCode) : _mm256_cmpeq_epi32(slotCodes, wantCode);
+        match = _mm256_and_si256(match, _mm256_cmpgt_epi32(slotPrices, lowBound));
+        match = _mm256_and_si256(match, _mm256_cmpgt_epi32(highBound, slotPrices));
+        int bits = _mm256_movemask_ps(_mm256_castsi256_ps(match));
+        for (int lane = 0; bits != 0; lane++, bits >>= 1) {
+            if (bits & 1) out[found++] = i + lane;
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i wantCode = _mm_set1_epi32(anyCategory ? -1 : code);
+    __m128i lowBound = _mm_set1_epi32(below);
+    __m128i highBound = _mm_set1_epi32(above);
+    for (; i + 4 <= count; i += 4) {
+        __m128i slotCodes = _mm_loadu_si128((const __m128i*)(codes + i));
+        __m128i slotPrices = _mm_loadu_si128((const __m128i*)(prices + i));
+        __m128i match = anyCategory ? _mm_cmpgt_epi32(slotCodes, wantCode) : _mm_cmpeq_epi32(slotCodes, wantCode);
+        match = _mm_and_si128(match, _mm_cmpgt_epi32(slotPrices, lowBound));
+        match = _mm_and_si128(match, _mm_cmpgt_epi32(highBound, slotPrices));
+        int bits = _mm_movemask_ps(_mm_castsi128_ps(match));
+        for (int lane = 0; lane < 4; lane++) {
+            if (bits & (1 << lane)) out[found++] = i + lane;
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        bool codeMatches = anyCategory ? codes[i] >= 0 : codes[i] == code;
+        if (codeMatches && prices[i] >= low && prices[i] <= high) out[found++] = i;
+    }
+    return found;
+}
+
+vector<Product*> queryProducts(Catalog& catalog, const ProductQuery& query) {
+    vector<Product*> results;
+    int code = -1;
+    if (!query.category.empty()) {
+        code = catalog.getCategories().find(query.category);
+        if (code < 0) return results;
+    }
+
+    int32_t low = (int32_t)max(query.minPriceCents, 0LL);
+    int32_t high = (int32_t)min(query.maxPriceCents, (long long)numeric_limits<int32_t>::max() - 1);
+    if (low > high) return results;
+
+    // The columns are filtered a chunk at a time so the match buffer stays small
+    // and in cache however large the catalog is.
+    const int CHUNK = 4096;
+    int32_t slots[CHUNK];
+    int count = catalog.slotLimit();
+    const int32_t* codes = catalog.categoryColumn();
+    const int32_t* prices = catalog.priceColumn();
+    vector<pair<int32_t, int32_t>> candidates;
+    for (int start = 0; start < count; start += CHUNK) {
+        int matched = filterProductColumns(codes + start, prices + start, min(CHUNK, count - start), code, low, high, slots);
+        for (int i = 0; i < matched; i++) {
+            int slot = start + slots[i];
+            if (query.inStockOnly && catalog.productAt(slot)->getStock() <= 0) continue;
+            candidates.push_back(make_pair(prices[slot], slot));
+        }
+    }
+
+    size_t keep = candidates.size();
+    if (query.limit > 0 && (size_t)query.limit < keep) keep = query.limit;
+    partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end());
+
+    results.reserve(keep);
+    for (size_t i = 0; i < keep; i++) results.push_back(catalog.productAt(candidates[i].second));
+    return results;
+}
+
+// --------------------- File Sync ---------------------
+// Flushes a stream through the OS cache to disk.
+bool syncFile(FILE* file) {
+    if (fflush(file) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Cuts a file opened for appending back to size bytes, e.g. after a failed write.
+bool cutFile(FILE* file, long long size) {
+    clearerr(file);
+#ifdef _WIN32
+    bool cut = _chsize_s(_fileno(file), size) == 0;
+#else
+    bool cut = ftruncate(fileno(file), (off_t)size) == 0;
+#endif
+    return cut && fseek(file, 0, SEEK_END) == 0;
+}
+
+bool syncPath(const string& path) {
+    FILE* file = fopen(path.c_str(), "rb+");
+    if (file == NULL) return false;
+    bool synced = syncFile(file);
+    fclose(file);
+    return synced;
+}
+
+// Moves a fully written temp file over path in one step, so a crash leaves either
+// the old file or the new one, then makes the rename itself durable.
+bool replaceFile(const string& tempPath, const string& path) {
+#ifdef _WIN32
+    return MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (rename(tempPath.c_str(), path.c_str()) != 0) return false;
+    size_t slash = path.find_last_of('/');
+    string directory = slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool synced = fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+#endif
+}
+
+// --------------------- Catalog File ---------------------
+// Binary, column-oriented catalog snapshot:
+//   header | ids (int32) | prices in cents (int64) | stock (int32) | category codes (int32)
+//   | name offsets (uint32, n+1) | category offsets (uint32, c+1) | string heap
+// Every column starts on an 8-byte boundary. Names and category strings live in the
+// heap; categories are stored once and referenced by code. The file is memory-mapped
+// (or read in one go where mmap isn't available) and its columns are read in place.
+const char CATALOG_FILE_MAGIC[8] = {'S', 'H', 'O', 'P', 'C', 'A', 'T', '1'};
+const uint32_t CATALOG_FILE_VERSION = 3;
+
+struct CatalogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t productCount;
+    uint32_t categoryCount;
+    uint32_t reserved;
+    uint64_t journalSequence;
+    uint64_t idsOffset;
+    uint64_t pricesOffset;
+    uint64_t stockOffset;
+    uint64_t categoryCodesOffset;
+    uint64_t nameOffsetsOffset;
+    uint64_t categoryOffsetsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+};
+
+class CatalogFile {
+private:
+    const char* data;
+    size_t size;
+    bool mapped;
+    vector<char> buffer;
+    const CatalogFileHeader* header;
+
+    template <typename T>
+    const T* column(uint64_t offset) { return (const T*)(data + offset); }
+
+    bool columnFits(uint64_t offset, uint64_t count, uint64_t width) {
+        return offset % 8 == 0 && offset <= size && count * width <= size - offset;
+    }
+
+    bool offsetsValid(const uint32_t* offsets, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header->stringsSize) return false;
+        }
+        return true;
+    }
+
+    bool validate() {
+        if (size < sizeof(CatalogFileHeader)) return false;
+        header = (const CatalogFileHeader*)data;
+        if (memcmp(header->magic, CATALOG_FILE_MAGIC, 8) != 0 || header->version != CATALOG_FILE_VERSION) return false;
+
+        uint64_t n = header->productCount;
+        if (!columnFits(header->idsOffset, n, 4) || !columnFits(header->pricesOffset, n, 8)
+            || !columnFits(header->stockOffset, n, 4) || !columnFits(header->categoryCodesOffset, n, 4)
+            || !columnFits(header->nameOffsetsOffset, n + 1, 4)
+            || !columnFits(header->categoryOffsetsOffset, header->categoryCount + 1, 4)
+            || !columnFits(header->stringsOffset, header->stringsSize, 1)) return false;
+
+        if (!offsetsValid(column<uint32_t>(header->nameOffsetsOffset), header->productCount)) return false;
+        if (!offsetsValid(column<uint32_t>(header->categoryOffsetsOffset), header->categoryCount)) return false;
+
+        const int32_t* codes = column<int32_t>(header->categoryCodesOffset);
+        for (uint32_t i = 0; i < header->productCount; i++) {
+            if (codes[i] < 0 || (uint32_t)codes[i] >= header->categoryCount) return false;
+        }
+        return true;
+    }
+
+    string_view heapString(const uint32_t* offsets, int index) {
+        const char* strings = data + header->stringsOffset;
+        return string_view(strings + offsets[index], offsets[index + 1] - offsets[index]);
+    }
+
+public:
+    CatalogFile() {
+        data = NULL;
+        size = 0;
+        mapped = false;
+        header = NULL;
+    }
+
+    CatalogFile(const CatalogFile&) = delete;
+    CatalogFile& operator=(const CatalogFile&) = delete;
+
+    ~CatalogFile() { close(); }
+
+    // Returns false if the file is missing or not a valid catalog.
+    bool open(const string& path) {
+        close();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED) {
+                data = (const char*)view;
+                size = (size_t)info.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+#endif
+        if (!mapped) {
+            ifstream in(path, ios::binary | ios::ate);
+            if (!in) return false;
+            buffer.resize((size_t)in.tellg());
+            in.seekg(0);
+            if (!in.read(buffer.data(), buffer.size())) return false;
+            data = buffer.data();
+            size = buffer.size();
+        }
+
+        if (!validate()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifndef _WIN32
+        if (mapped) munmap((void*)data, size);
+#endif
+        buffer.clear();
+        buffer.shrink_to_fit();
+        data = NULL;
+        size = 0;
+        mapped = false;
+        header = NULL;
+    }
+
+    int getProductCount() { return header == NULL ? 0 : (int)header->productCount; }
+    uint64_t getJournalSequence() { return header == NULL ? 0 : header->journalSequence; }
+    int getId(int index) { return column<int32_t>(header->idsOffset)[index]; }
+    long long getPriceCents(int index) { return column<int64_t>(header->pricesOffset)[index]; }
+    int getStock(int index) { return column<int32_t>(header->stockOffset)[index]; }
+
+    string_view getName(int index) {
+        return heapString(column<uint32_t>(header->nameOffsetsOffset), index);
+    }
+
+    string_view getCategory(int index) {
+        int code = column<int32_t>(header->categoryCodesOffset)[index];
+        return heapString(column<uint32_t>(header->categoryOffsetsOffset), code);
+    }
+
+    // Adds every product in the file to the catalog and hands the file over to it.
+    // Names are not copied: the products view them in the mapping, and only the
+    // mutable fields (price, stock) move into the catalog's slots. Returns how
+    // many products were added.
+    static int loadInto(CatalogFile* file, Catalog& catalog) {
+        int count = file->getProductCount();
+        catalog.reserve(catalog.size() + count);
+        int added = 0;
+        for (int i = 0; i < count; i++) {
+            Product product(file->getId(i), file->getName(i), file->getCategory(i), file->getPriceCents(i), file->getStock(i));
+            if (catalog.addInPlace(product).get() != NULL) added++;
+        }
+        catalog.adoptFile(file);
+        return added;
+    }
+
+    // Writes to a temporary file first so a crash mid-write never leaves a torn catalog.
+    // journalSequence records the last journal entry the snapshot already reflects.
+    static bool write(Catalog& catalog, const string& path, uint64_t journalSequence = 0) {
+        vector<int32_t> ids, stock, codes;
+        vector<int64_t> prices;
+        vector<uint32_t> nameOffsets(1, 0), categoryOffsets(1, 0);
+        string strings, names;
+        MyHashMap<string_view, int> codeByCategory;
+
+        for (int i = 0; i < catalog.slotLimit(); i++) {
+            Product* product = catalog.productAt(i);
+            if (product == NULL) continue;
+            ids.push_back(product->getId());
+            prices.push_back(product->getPriceCents());
+            stock.push_back(product->getStock());
+            names += product->getName();
+            nameOffsets.push_back((uint32_t)names.size());
+
+            string_view category = product->getCategory();
+            int* code = codeByCategory.find(category);
+            if (code == NULL) {
+                int newCode = (int)categoryOffsets.size() - 1;
+                codeByCategory.insert(category, newCode);
+                strings += category;
+                categoryOffsets.push_back((uint32_t)strings.size());
+                codes.push_back(newCode);
+            } else {
+                codes.push_back(*code);
+            }
+        }
+        // Names go after the category strings; all offsets are relative to the heap start.
+        for (size_t i = 0; i < nameOffsets.size(); i++) nameOffsets[i] += (uint32_t)strings.size();
+        strings += names;
+
+        CatalogFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CATALOG_FILE_MAGIC, 8);
+        header.version = CATALOG_FILE_VERSION;
+        header.productCount = (uint32_t)ids.size();
+        header.categoryCount = (uint32_t)categoryOffsets.size() - 1;
+        header.journalSequence = journalSequence;
+
+        uint64_t offset = sizeof(CatalogFileHeader);
+        auto place = [&offset](uint64_t bytes) {
+            offset = (offset + 7) / 8 * 8;
+            uint64_t start = offset;
+            offset += bytes;
+            return start;
+        };
+        header.idsOffset = place(ids.size() * 4);
+        header.pricesOffset = place(prices.size() * 8);
+        header.stockOffset = place(stock.size() * 4);
+        header.categoryCodesOffset = place(codes.size() * 4);
+        header.nameOffsetsOffset = place(nameOffsets.size() * 4);
+        header.categoryOffsetsOffset = place(categoryOffsets.size() * 4);
+        header.stringsOffset = place(strings.size());
+        header.stringsSize = strings.size();
+
+        string tempPath = path + ".tmp";
+        ofstream out(tempPath, ios::binary | ios::trunc);
+        if (!out) return false;
+
+        uint64_t written = 0;
+        auto put = [&out, &written](uint64_t at, const void* bytes, uint64_t length) {
+            static const char zeros[8] = {0};
+            if (at > written) out.write(zeros, (streamsize)(at - written));
+            out.write((const char*)bytes, (streamsize)length);
+            written = at + length;
+        };
+        put(0, &header, sizeof(header));
+        put(header.idsOffset, ids.data(), ids.size() * 4);
+        put(header.pricesOffset, prices.data(), prices.size() * 8);
+        put(header.stockOffset, stock.data(), stock.size() * 4);
+        put(header.categoryCodesOffset, codes.data(), codes.size() * 4);
+        put(header.nameOffsetsOffset, nameOffsets.data(), nameOffsets.size() * 4);
+        put(header.categoryOffsetsOffset, categoryOffsets.data(), categoryOffsets.size() * 4);
+        put(header.stringsOffset, strings.data(), strings.size());
+        out.close();
+        if (!out || !syncPath(tempPath)) return false;
+        return replaceFile(tempPath, path);
+    }
+};
+
+Catalog::~Catalog() {
+    for (int i = 0; i < (int)blocks.size(); i++) delete[] blocks[i];
+    for (size_t i = 0; i < sourceFiles.size(); i++) delete sourceFiles[i];
+}
+
+// --------------------- CartItem Node ---------------------
+struct CartItem {
+    ProductHandle product;
+    int quantity;
+    CartItem* next;
+    CartItem* prev;
+    CartItem() : quantity(0), next(NULL), prev(NULL) {}
+    CartItem(ProductHandle productItem, int quantityItem)
+        : product(productItem), quantity(quantityItem), next(NULL), prev(NULL) {}
+};
+
+// --------------------- CartItem Pool ---------------------
+// Hands out nodes for a single list. The first INLINE_NODES live inside the pool
+// itself, so small carts never touch the heap; larger carts carve nodes from blocks
+// that are kept until the pool is destroyed. Released nodes are reused first, and
+// reset() recycles every node at once without walking the list.
+class CartItemPool {
+private:
+    static const int INLINE_NODES = 8;
+    static const int BLOCK_NODES = 64;
+
+    CartItem inlineNodes[INLINE_NODES];
+    vector<CartItem*> blocks;
+    CartItem* freeList;
+    int carved;
+
+public:
+    CartItemPool() {
+        freeList = NULL;
+        carved = 0;
+    }
+
+    CartItemPool(const CartItemPool&) = delete;
+    CartItemPool& operator=(const CartItemPool&) = delete;
+
+    CartItem* acquire(ProductHandle product, int quantity) {
+        CartItem* node;
+        if (freeList != NULL) {
+            node = freeList;
+            freeList = node->next;
+        } else if (carved < INLINE_NODES) {
+            node = &inlineNodes[carved++];
+        } else {
+            int index = carved - INLINE_NODES;
+            if (index / BLOCK_NODES == (int)blocks.size()) {
+                blocks.push_back(new CartItem[BLOCK_NODES]);
+                METRIC_ALLOCATION(ALLOC_CART_ITEM_BLOCK);
+            }
+            node = &blocks[index / BLOCK_NODES][index % BLOCK_NODES];
+            carved++;
+        }
+        node->product = product;
+        node->quantity = quantity;
+        node->next = NULL;
+        node->prev = NULL;
+        METRIC_ALLOCATION(ALLOC_CART_ITEM);
+        return node;
+    }
+
+    void release(CartItem* node) {
+        node->next = freeList;
+        freeList = node;
+    }
+
+    void reset() {
+        freeList = NULL;
+        carved = 0;
+    }
+
+    ~CartItemPool() {
+        for (int i = 0; i < (int)blocks.size(); i++) delete[] blocks[i];
+    }
+};
+
+// --------------------- Custom Linked List ---------------------
+// Keeps insertion order with head/tail pointers. Once a list grows past
+// INDEX_THRESHOLD lines it also keeps a product -> node index, so add, merge and
+// remove stay O(1); shorter lists just scan their (pool-contiguous) nodes.
+class MyLinkedList {
+private:
+    static const int INDEX_THRESHOLD = 8;
+
+    CartItem* head;
+    CartItem* tail;
+    int count;
+    MyHashMap<ProductHandle, CartItem*, ProductHandleHash> index;
+    CartItemPool pool;
+    long long subtotalCents;
+    unsigned long long pricedAtEpoch;
+
+    // While no price has changed since the subtotal was last computed, it is kept
+    // up to date line by line; otherwise it is left stale until someone asks.
+    void adjustSubtotal(ProductHandle product, int quantityDelta) {
+        if (pricedAtEpoch != Product::priceEpoch.load()) return;
+        Product* current = product.get();
+        if (current != NULL) subtotalCents += current->getPriceCents() * quantityDelta;
+    }
+
+    CartItem* findItem(ProductHandle product) {
+        if (count > INDEX_THRESHOLD) {
+            CartItem** found = index.find(product);
+            return found == NULL ? NULL : *found;
+        }
+        for (CartItem* temp = head; temp != NULL; temp = temp->next) {
+            if (temp->product == product) return temp;
+        }
+        return NULL;
+    }
+
+    void append(ProductHandle product, int quantity) {
+        CartItem* newItem = pool.acquire(product, quantity);
+        newItem->prev = tail;
+        if (tail == NULL) head = newItem;
+        else tail->next = newItem;
+        tail = newItem;
+        count++;
+
+        if (count == INDEX_THRESHOLD + 1) {
+            for (CartItem* temp = head; temp != NULL; temp = temp->next) index.insert(temp->product, temp);
+        } else if (count > INDEX_THRESHOLD) {
+            index.insert(product, newItem);
+        }
+    }
+
+    void unlink(CartItem* item) {
+        if (item->prev == NULL) head = item->next;
+        else item->prev->next = item->next;
+        if (item->next == NULL) tail = item->prev;
+        else item->next->prev = item->prev;
+
+        if (count > INDEX_THRESHOLD) index.erase(item->product);
+        count--;
+        if (count == INDEX_THRESHOLD) index.clear();
+        pool.release(item);
+    }
+
+    void appendAll(const MyLinkedList& other) {
+        for (CartItem* temp = other.head; temp != NULL; temp = temp->next) append(temp->product, temp->quantity);
+        subtotalCents = other.subtotalCents;
+        pricedAtEpoch = other.pricedAtEpoch;
+    }
+
+public:
+    MyLinkedList() {
+        head = NULL;
+        tail = NULL;
+        count = 0;
+        subtotalCents = 0;
+        pricedAtEpoch = Product::priceEpoch.load();
+    }
+
+    MyLinkedList(const MyLinkedList& other) {
+        head = NULL;
+        tail = NULL;
+        count = 0;
+        appendAll(other);
+    }
+
+    MyLinkedList& operator=(const MyLinkedList& other) {
+        if (this != &other) {
+            clear();
+            appendAll(other);
+        }
+        return *this;
+    }
+
+    void add(ProductHandle product, int quantity) {
+        CartItem* existing = findItem(product);
+        if (existing != NULL) existing->quantity += quantity;
+        else append(product, quantity);
+        adjustSubtotal(product, quantity);
+    }
+
+    void remove(ProductHandle product, int quantityToRemove) {
+        CartItem* existing = findItem(product);
+        if (existing == NULL) return;
+        if (quantityToRemove >= existing->quantity) {
+            adjustSubtotal(product, -existing->quantity);
+            unlink(existing);
+        } else {
+            existing->quantity -= quantityToRemove;
+            adjustSubtotal(product, -quantityToRemove);
+        }
+    }
+
+    long long getSubtotalCents() {
+        unsigned long long epoch = Product::priceEpoch.load();
+        if (pricedAtEpoch != epoch) {
+            subtotalCents = 0;
+            for (CartItem* temp = head; temp != NULL; temp = temp->next) {
+                Product* product = temp->product.get();
+                if (product != NULL) subtotalCents += product->getPriceCents() * temp->quantity;
+            }
+            pricedAtEpoch = epoch;
+        }
+        return subtotalCents;
+    }
+
+    void display() {
+        OutputBuffer out(cout);
+        if (head == NULL) {
+            out.put("Cart is empty.\n");
+            return;
+        }
+
+        CartItem* temp = head;
+        out.put("Current Cart:\n");
+        while (temp != NULL) {
+            Product* product = temp->product.get();
+            if (product == NULL) {
+                out.put("(no longer available) x").put(temp->quantity).put('\n');
+            } else {
+                out.put(product->getName()).put(" x").put(temp->quantity)
+                   .put(" - $").putMoney(product->getPriceCents())
+                   .put(" each, Total: $").putMoney(temp->quantity * product->getPriceCents())
+                   .put('\n');
+            }
+            temp = temp->next;
+        }
+        out.put("Subtotal: $").putMoney(getSubtotalCents()).put('\n');
+    }
+
+    CartItem* getHead() { return head; }
+
+    int size() { return count; }
+
+    int quantityOf(ProductHandle product) {
+        CartItem* existing = findItem(product);
+        return existing == NULL ? 0 : existing->quantity;
+    }
+
+    void clear() {
+        head = NULL;
+        tail = NULL;
+        if (count > INDEX_THRESHOLD) index.clear();
+        count = 0;
+        pool.reset();
+        subtotalCents = 0;
+        pricedAtEpoch = Product::priceEpoch.load();
+    }
+};
+
+// --------------------- Password Hashing ---------------------
+// Plain SHA-256 (FIPS 180-4), used to store passwords as salted hashes.
+class Sha256 {
+private:
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t blockUsed;
+    uint64_t totalBytes;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress() {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16)
+                 | ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+public:
+    Sha256() {
+        static const uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        for (int i = 0; i < 8; i++) state[i] = init[i];
+        blockUsed = 0;
+        totalBytes = 0;
+    }
+
+    void update(const void* data, size_t length) {
+        const unsigned char* bytes = (const unsigned char*)data;
+        totalBytes += length;
+        while (length > 0) {
+            size_t take = 64 - blockUsed;
+            if (take > length) take = length;
+            memcpy(block + blockUsed, bytes, take);
+            blockUsed += take;
+            bytes += take;
+            length -= take;
+            if (blockUsed == 64) {
+                compress();
+                blockUsed = 0;
+            }
+        }
+    }
+
+    void finish(unsigned char digest[32]) {
+        uint64_t bitLength = totalBytes * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (blockUsed != 56) update(&pad, 1);
+        unsigned char lengthBytes[8];
+        for (int i = 0; i < 8; i++) lengthBytes[i] = (unsigned char)(bitLength >> (56 - 8 * i));
+        update(lengthBytes, 8);
+        for (int i = 0; i < 8; i++) {
+            digest[i * 4] = (unsigned char)(state[i] >> 24);
+            digest[i * 4 + 1] = (unsigned char)(state[i] >> 16);
+            digest[i * 4 + 2] = (unsigned char)(state[i] >> 8);
+            digest[i * 4 + 3] = (unsigned char)state[i];
+        }
+    }
+};
+
+// --------------------- User Class ---------------------
+// The password is never stored; only SHA-256(salt + password) with a random
+// per-user salt is kept.
+class User {
+private:
+    static const int SALT_SIZE = 16;
+    static const int HASH_SIZE = 32;
+
+    const string name;
+    const string email;
+    unsigned char salt[SALT_SIZE];
+    unsigned char passwordHash[HASH_SIZE];
+
+    void hashPassword(string_view password, unsigned char out[HASH_SIZE]) {
+        Sha256 hasher;
+        hasher.update(salt, SALT_SIZE);
+        hasher.update(password.data(), password.size());
+        hasher.finish(out);
+    }
+
+public:
+    User(string_view userName, string_view userEmail, string_view userPassword)
+        : name(userName), email(userEmail) {
+        static thread_local mt19937_64 saltSource(random_device{}());
+        for (int i = 0; i < SALT_SIZE; i++) salt[i] = (unsigned char)saltSource();
+        hashPassword(userPassword, passwordHash);
+    }
+
+    const string& getEmail() { return email; }
+    const string& getName() { return name; }
+
+    bool checkPassword(string_view loginPassword) {
+        unsigned char attempt[HASH_SIZE];
+        hashPassword(loginPassword, attempt);
+        unsigned char diff = 0;
+        for (int i = 0; i < HASH_SIZE; i++) diff |= attempt[i] ^ passwordHash[i];
+        return diff == 0;
+    }
+};
+
+// --------------------- User Directory ---------------------
+// Emails compare case-insensitively and ignore surrounding whitespace, without
+// building a normalized copy, so lookups take a string_view and never allocate.
+string_view trimEmail(string_view email) {
+    while (!email.empty() && isspace((unsigned char)email.front())) email.remove_prefix(1);
+    while (!email.empty() && isspace((unsigned char)email.back())) email.remove_suffix(1);
+    return email;
+}
+
+struct EmailHash {
+    unsigned int operator()(string_view email) const {
+        email = trimEmail(email);
+        unsigned int h = 2166136261u;
+        for (size_t i = 0; i < email.size(); i++) {
+            h ^= (unsigned char)tolower((unsigned char)email[i]);
+            h *= 16777619u;
+        }
+        return h;
+    }
+};
+
+struct EmailEqual {
+    bool operator()(string_view a, string_view b) const {
+        a = trimEmail(a);
+        b = trimEmail(b);
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+        }
+        return true;
+    }
+};
+
+class UserDirectory {
+private:
+    deque<User> users;
+    // Keys view the users' own email strings; deque never moves its elements.
+    MyHashMap<string_view, User*, EmailHash, EmailEqual> byEmail;
+
+public:
+    bool isEmailUnique(string_view email) {
+        return byEmail.find(email) == NULL;
+    }
+
+    // Returns NULL if the email is already registered.
+    User* registerUser(string_view name, string_view email, string_view password) {
+        if (!isEmailUnique(email)) return NULL;
+        users.emplace_back(name, trimEmail(email), password);
+        User* added = &users.back();
+        byEmail.insert(added->getEmail(), added);
+        return added;
+    }
+
+    // Returns NULL if the email is unknown or the password is wrong.
+    User* login(string_view email, string_view password) {
+        METRIC_TIME(METRIC_LOGIN);
+        User** found = byEmail.find(email);
+        if (found == NULL || !(*found)->checkPassword(password)) return NULL;
+        return *found;
+    }
+
+    int size() { return (int)users.size(); }
+};
+
+// --------------------- CartAction ---------------------
+enum CartOpcode {
+    CART_ADD = 0,
+    CART_REMOVE = 1
+};
+
+// One undo entry in 16 bytes: the product handle split into its fields, plus the
+// opcode, a "continues the previous entry's group" flag and the quantity packed
+// into one word.
+struct CartAction {
+    static const uint32_t OPCODE_BIT = 1u << 31;
+    static const uint32_t GROUPED_BIT = 1u << 30;
+    static const int MAX_QUANTITY = (1 << 30) - 1;
+
+    ProductSlot* slot;
+    int generation;
+    uint32_t packed;
+
+    CartAction() : slot(NULL), generation(0), packed(0) {}
+
+    CartAction(CartOpcode opcode, ProductHandle product, int quantity, bool grouped) {
+        slot = product.slot;
+        generation = product.generation;
+        packed = (uint32_t)quantity | (opcode == CART_REMOVE ? OPCODE_BIT : 0) | (grouped ? GROUPED_BIT : 0);
+    }
+
+    CartOpcode opcode() const { return (packed & OPCODE_BIT) ? CART_REMOVE : CART_ADD; }
+    bool grouped() const { return (packed & GROUPED_BIT) != 0; }
+    int quantity() const { return (int)(packed & MAX_QUANTITY); }
+    ProductHandle product() const { return ProductHandle(slot, generation); }
+
+    void setQuantity(int quantity) { packed = (packed & ~(uint32_t)MAX_QUANTITY) | (uint32_t)quantity; }
+    void setGrouped(bool grouped) { packed = grouped ? (packed | GROUPED_BIT) : (packed & ~GROUPED_BIT); }
+};
+
+// --------------------- Undo Log ---------------------
+// Bounded undo/redo history kept in one ring. Entries before the cursor can be
+// undone, entries after it redone; recording a new action discards the redo
+// side. When the ring is full the oldest entry (and the rest of its group) is
+// dropped. Consecutive actions of the same kind on the same product merge into
+// one entry unless a group boundary lies between them.
+class UndoLog {
+private:
+    CartAction* ring;
+    int capacity;
+    int oldest;
+    int undoCount;
+    int redoCount;
+    int groupDepth;
+    bool groupStarted;
+    bool canCoalesce;
+
+    CartAction& entry(int position) { return ring[(oldest + position) % capacity]; }
+
+    void dropOldest() {
+        do {
+            oldest = (oldest + 1) % capacity;
+            undoCount--;
+        } while (undoCount > 0 && ring[oldest].grouped());
+    }
+
+public:
+    UndoLog(int limit) {
+        ring = NULL;
+        capacity = limit < 1 ? 1 : limit;
+        oldest = 0;
+        undoCount = 0;
+        redoCount = 0;
+        groupDepth = 0;
+        groupStarted = false;
+        canCoalesce = false;
+    }
+
+    UndoLog(const UndoLog&) = delete;
+    UndoLog& operator=(const UndoLog&) = delete;
+
+    ~UndoLog() { delete[] ring; }
+
+    // Everything recorded between beginGroup and the matching endGroup is undone
+    // and redone as one step. Groups may nest; only the outermost one counts.
+    void beginGroup() {
+        if (groupDepth++ == 0) {
+            groupStarted = false;
+            canCoalesce = false;
+        }
+    }
+
+    void endGroup() {
+        if (groupDepth > 0 && --groupDepth == 0) canCoalesce = false;
+    }
+
+    void record(CartOpcode opcode, ProductHandle product, int quantity) {
+        if (quantity <= 0) return;
+        if (quantity > CartAction::MAX_QUANTITY) quantity = CartAction::MAX_QUANTITY;
+        redoCount = 0;
+
+        if (canCoalesce && undoCount > 0) {
+            CartAction& last = entry(undoCount - 1);
+            if (last.opcode() == opcode && last.product() == product
+                && last.quantity() <= CartAction::MAX_QUANTITY - quantity) {
+                last.setQuantity(last.quantity() + quantity);
+                return;
+            }
+        }
+
+        if (ring == NULL) ring = new CartAction[capacity];
+        bool grouped = groupDepth > 0 && groupStarted;
+        if (undoCount == capacity) {
+            dropOldest();
+            // The group this entry continues may just have been dropped.
+            if (undoCount == 0) grouped = false;
+        }
+        entry(undoCount++) = CartAction(opcode, product, quantity, grouped);
+        if (groupDepth > 0) groupStarted = true;
+        canCoalesce = true;
+    }
+
+    // Moves the cursor back over one step and calls apply for each entry in it,
+    // newest first. Returns false if there is nothing to undo.
+    bool undo(function<void(const CartAction&)> apply) {
+        if (undoCount == 0) return false;
+        canCoalesce = false;
+        bool more = true;
+        while (more && undoCount > 0) {
+            CartAction& action = entry(--undoCount);
+            redoCount++;
+            more = action.grouped();
+            apply(action);
+        }
+        return true;
+    }
+
+    // Replays the step just after the cursor, oldest entry first.
+    bool redo(function<void(const CartAction&)> apply) {
+        if (redoCount == 0) return false;
+        canCoalesce = false;
+        do {
+            apply(entry(undoCount++));
+            redoCount--;
+        } while (redoCount > 0 && entry(undoCount).grouped());
+        return true;
+    }
+
+    // Forgets all history, including any group still open.
+    void clear() {
+        oldest = 0;
+        undoCount = 0;
+        redoCount = 0;
+        groupDepth = 0;
+        groupStarted = false;
+        canCoalesce = false;
+    }
+
+    int size() { return undoCount; }
+};
+
+// --------------------- Cart Class ---------------------
+const int DEFAULT_UNDO_LIMIT = 64;
+
+class Cart {
+private:
+    MyLinkedList cartItems;
+    UndoLog undoLog;
+    function<void(ProductHandle, int)> lineChanged;
+    ostream* output;
+
+    void notifyLine(ProductHandle handle) {
+        if (lineChanged) lineChanged(handle, cartItems.quantityOf(handle));
+    }
+
+public:
+    Cart(int undoLimit = DEFAULT_UNDO_LIMIT) : undoLog(undoLimit), output(&cout) {}
+
+    // Where the cart's messages go; cout unless the caller collects them, e.g.
+    // when the cart is driven from a session worker.
+    void setOutput(ostream& stream) { output = &stream; }
+
+    // Called with the product and its new quantity (0 once removed) after every
+    // change made through addToCart, removeFromCart, undoLastAction or redoLastAction.
+    void setLineListener(function<void(ProductHandle, int)> listener) { lineChanged = listener; }
+
+    // Puts a line back to a known quantity without recording undo history.
+    void restoreLine(ProductHandle handle, int quantity) {
+        cartItems.remove(handle, numeric_limits<int>::max());
+        if (quantity > 0 && handle.get() != NULL) cartItems.add(handle, quantity);
+    }
+
+    void addToCart(ProductHandle handle, int quantityToAdd) {
+        METRIC_TIME(METRIC_CART_ADD);
+        Product* product = handle.get();
+        if (quantityToAdd > product->getStock()) {
+            *output << "Not enough stock. Available: " << product->getStock() << '\n';
+            return;
+        }
+        cartItems.add(handle, quantityToAdd);
+        undoLog.record(CART_ADD, handle, quantityToAdd);
+        notifyLine(handle);
+        *output << "Added " << product->getName() << " x" << quantityToAdd << " to cart.\n";
+    }
+
+    void removeFromCart(ProductHandle handle, int quantityToRemove) {
+        METRIC_TIME(METRIC_CART_REMOVE);
+        int before = cartItems.quantityOf(handle);
+        cartItems.remove(handle, quantityToRemove);
+        undoLog.record(CART_REMOVE, handle, before - cartItems.quantityOf(handle));
+        notifyLine(handle);
+        *output << "Removed " << handle.get()->getName() << " x" << quantityToRemove << " from cart.\n";
+    }
+
+    // Operations made between these two calls undo and redo together.
+    void beginTransaction() { undoLog.beginGroup(); }
+    void endTransaction() { undoLog.endGroup(); }
+
+    void undoLastAction() {
+        METRIC_TIME(METRIC_CART_UNDO);
+        bool undone = undoLog.undo([this](const CartAction& action) {
+            ProductHandle product = action.product();
+            if (action.opcode() == CART_ADD) {
+                cartItems.remove(product, action.quantity());
+            } else if (product.get() != NULL) {
+                cartItems.add(product, action.quantity());
+            }
+            notifyLine(product);
+        });
+        if (undone) *output << "Undo action performed.\n";
+        else *output << "Nothing to undo.\n";
+    }
+
+    void redoLastAction() {
+        bool redone = undoLog.redo([this](const CartAction& action) {
+            ProductHandle product = action.product();
+            if (action.opcode() == CART_REMOVE) {
+                cartItems.remove(product, action.quantity());
+            } else if (product.get() != NULL) {
+                cartItems.add(product, action.quantity());
+            }
+            notifyLine(product);
+        });
+        if (redone) *output << "Redo action performed.\n";
+        else *output << "Nothing to redo.\n";
+    }
+
+    void displayCart() { cartItems.display(); }
+    MyLinkedList& getItems() { return cartItems; }
+    // Empties the cart and its undo history, as after a checkout.
+    void clear() {
+        cartItems.clear();
+        undoLog.clear();
+    }
+};
+
+// --------------------- Stock Reservation ---------------------
+// Reserves stock for every line of a cart or for none of them. Each product's stock
+// is claimed with its own compare-and-swap, so buyers of different products never
+// wait on each other and nobody can oversell. The reservation is handed back when
+// the object goes out of scope unless commit() was called.
+class StockReservation {
+private:
+    MyLinkedList* items;
+    CartItem* failedItem;
+    bool held;
+
+    void releaseUpTo(CartItem* end) {
+        for (CartItem* temp = items->getHead(); temp != end; temp = temp->next) {
+            Product* product = temp->product.get();
+            if (product != NULL) product->releaseStock(temp->quantity);
+        }
+    }
+
+public:
+    StockReservation(MyLinkedList& cartItems) {
+        items = &cartItems;
+        failedItem = NULL;
+        held = true;
+
+        for (CartItem* temp = items->getHead(); temp != NULL; temp = temp->next) {
+            Product* product = temp->product.get();
+            if (product == NULL) continue;
+            if (!product->reserveStock(temp->quantity)) {
+                releaseUpTo(temp);
+                failedItem = temp;
+                held = false;
+                return;
+            }
+        }
+    }
+
+    StockReservation(const StockReservation&) = delete;
+    StockReservation& operator=(const StockReservation&) = delete;
+
+    bool isHeld() { return held; }
+    CartItem* getFailedItem() { return failedItem; }
+
+    void commit() { held = false; }
+
+    void release() {
+        if (!held) return;
+        releaseUpTo(NULL);
+        held = false;
+    }
+
+    ~StockReservation() { release(); }
+};
+
+// --------------------- Order Class ---------------------
+// One purchased line, with the price it was bought at. The name is kept as well
+// (a view into the catalog's arena) so the line still reads the same after the
+// product is removed.
+struct OrderLine {
+    ProductHandle product;
+    int quantity;
+    long long unitPriceCents;
+    long long chargedCents; // what the line contributed to the order total
+    string_view name;
+};
+
+// An order's lines never change once it is placed, so they live in a single
+// reference-counted block (header followed by the lines) that copies of the
+// order share instead of duplicating.
+class Order {
+private:
+    struct LineBlock {
+        atomic<int> references;
+        int count;
+
+        OrderLine* lines() { return (OrderLine*)(this + 1); }
+    };
+
+    int orderId;
+    LineBlock* block;
+    long long totalCents;
+    long long placedAt; // seconds since the Unix epoch
+
+    static LineBlock* allocateLines(int count) {
+        if (count == 0) return NULL;
+        LineBlock* created = (LineBlock*)::operator new(sizeof(LineBlock) + count * sizeof(OrderLine));
+        METRIC_ALLOCATION(ALLOC_ORDER_LINES);
+        new (&created->references) atomic<int>(1);
+        created->count = count;
+        return created;
+    }
+
+    void releaseLines() {
+        if (block != NULL && block->references.fetch_sub(1, memory_order_acq_rel) == 1) {
+            ::operator delete(block);
+        }
+        block = NULL;
+    }
+
+public:
+    Order() {
+        orderId = 0;
+        block = NULL;
+        totalCents = 0;
+        placedAt = 0;
+    }
+
+    // An order at list prices, with no discounts or tax.
+    Order(int newOrderId, MyLinkedList& cartItems) {
+        orderId = newOrderId;
+        totalCents = cartItems.getSubtotalCents();
+        placedAt = (long long)time(NULL);
+
+        int liveLines = 0;
+        for (CartItem* temp = cartItems.getHead(); temp != NULL; temp = temp->next) {
+            if (temp->product.get() != NULL) liveLines++;
+        }
+        block = allocateLines(liveLines);
+        int filled = 0;
+        for (CartItem* temp = cartItems.getHead(); temp != NULL && filled < liveLines; temp = temp->next) {
+            Product* product = temp->product.get();
+            if (product == NULL) continue;
+            long long unitCents = product->getPriceCents();
+            new (&block->lines()[filled++]) OrderLine{temp->product, temp->quantity, unitCents, unitCents * temp->quantity,
+                                                      product->getName()};
+        }
+    }
+
+    // Rebuilds an order recorded earlier, keeping the total it was placed at.
+    Order(int newOrderId, const vector<OrderLine>& orderLines, long long orderTotalCents, long long orderPlacedAt) {
+        orderId = newOrderId;
+        totalCents = orderTotalCents;
+        placedAt = orderPlacedAt;
+        block = allocateLines((int)orderLines.size());
+        for (size_t i = 0; i < orderLines.size(); i++) new (&block->lines()[i]) OrderLine(orderLines[i]);
+    }
+
+    Order(const Order& other) {
+        orderId = other.orderId;
+        block = other.block;
+        totalCents = other.totalCents;
+        placedAt = other.placedAt;
+        if (block != NULL) block->references.fetch_add(1, memory_order_relaxed);
+    }
+
+    Order(Order&& other) noexcept {
+        orderId = other.orderId;
+        block = other.block;
+        totalCents = other.totalCents;
+        placedAt = other.placedAt;
+        other.block = NULL;
+    }
+
+    Order& operator=(Order other) {
+        swap(orderId, other.orderId);
+        swap(block, other.block);
+        swap(totalCents, other.totalCents);
+        swap(placedAt, other.placedAt);
+        return *this;
+    }
+
+    ~Order() { releaseLines(); }
+
+    int getOrderId() { return orderId; }
+    long long getTotalCents() { return totalCents; }
+    long long getPlacedAt() { return placedAt; }
+    int getLineCount() { return block == NULL ? 0 : block->count; }
+    const OrderLine* getLines() { return block == NULL ? NULL : block->lines(); }
+
+    // CSV output has one row per line: order_id,product_id,name,quantity,unit_price.
+    void render(OutputBuffer& out, RenderFormat format) {
+        const OrderLine* lines = getLines();
+        if (format == RENDER_JSON) {
+            out.put("{\"id\":").put(orderId).put(",\"total\":").putMoney(totalCents).put(",\"lines\":[");
+            for (int i = 0; i < getLineCount(); i++) {
+                Product* product = lines[i].product.get();
+                if (i > 0) out.put(',');
+                out.put("{\"productId\":").put(product == NULL ? -1 : product->getId())
+                   .put(",\"name\":").putJsonString(lines[i].name)
+                   .put(",\"available\":").put(product == NULL ? "false" : "true");
+                out.put(",\"quantity\":").put(lines[i].quantity)
+                   .put(",\"unitPrice\":").putMoney(lines[i].unitPriceCents).put('}');
+            }
+            out.put("]}");
+        } else if (format == RENDER_CSV) {
+            for (int i = 0; i < getLineCount(); i++) {
+                Product* product = lines[i].product.get();
+                out.put(orderId).put(',').put(product == NULL ? -1 : product->getId()).put(',');
+                out.putCsvField(lines[i].name);
+                out.put(',').put(lines[i].quantity).put(',').putMoney(lines[i].unitPriceCents).put('\n');
+            }
+        } else {
+            out.put("Order ID: ").put(orderId).put(" Total: $").putMoney(totalCents).put('\n');
+            for (int i = 0; i < getLineCount(); i++) {
+                out.put(" - ").put(lines[i].name);
+                if (lines[i].product.get() == NULL) out.put(" (no longer available)");
+                out.put(" x").put(lines[i].quantity)
+                   .put(" - $").putMoney(lines[i].unitPriceCents).put('\n');
+            }
+        }
+    }
+
+    void display() {
+        OutputBuffer out(cout);
+        render(out, RENDER_TEXT);
+    }
+};
+
+void renderOrders(OutputBuffer& out, MyQueue<Order>& orders, RenderFormat format) {
+    if (format == RENDER_JSON) out.put('[');
+    if (format == RENDER_CSV) out.put("order_id,product_id,name,quantity,unit_price\n");
+    for (int i = 0; i < orders.size(); i++) {
+        if (format == RENDER_JSON && i > 0) out.put(',');
+        orders.at(i).render(out, format);
+    }
+    if (format == RENDER_JSON) out.put("]\n");
+}
+
+// --------------------- Session Manager ---------------------
+struct Session {
+    string email;
+    Cart cart;
+};
+
+// Gives every logged-in user their own Cart (and undo history). Sessions are split
+// into shards by a hash of the email, each with its own lock, so opening sessions
+// never takes a global lock. Work posted for a session runs on its shard's worker
+// thread, so one user's operations are applied in order with no locking on the cart
+// while different shards run in parallel. Workers start on the first post().
+class SessionManager {
+private:
+    struct Task {
+        Session* session;
+        function<void(Session&)> work;
+    };
+
+    struct Shard {
+        mutex lock;
+        condition_variable wake;
+        condition_variable idle;
+        MyHashMap<string, Session*> sessions;
+        vector<Session*> owned;
+        MyQueue<Task> tasks;
+        int pending;
+        bool stopping;
+        thread worker;
+
+        Shard() : pending(0), stopping(false) {}
+    };
+
+    Shard* shards;
+    int shardCount;
+
+    Shard& shardFor(string_view email) { return shards[MyHash()(email) % shardCount]; }
+
+    static void runWorker(Shard* shard) {
+        unique_lock<mutex> guard(shard->lock);
+        while (true) {
+            shard->wake.wait(guard, [shard] { return shard->stopping || !shard->tasks.isEmpty(); });
+            if (shard->tasks.isEmpty()) return;
+
+            Task task = std::move(shard->tasks.front());
+            shard->tasks.pop();
+            guard.unlock();
+            task.work(*task.session);
+            guard.lock();
+
+            shard->pending--;
+            if (shard->pending == 0) shard->idle.notify_all();
+        }
+    }
+
+    Session* openLocked(Shard& shard, string_view email) {
+        Session** found = shard.sessions.find(email);
+        if (found != NULL) return *found;
+        Session* session = new Session();
+        session->email = string(email);
+        shard.sessions.insert(session->email, session);
+        shard.owned.push_back(session);
+        return session;
+    }
+
+public:
+    SessionManager(int shardTotal = 0) {
+        if (shardTotal <= 0) shardTotal = (int)thread::hardware_concurrency();
+        shardCount = shardTotal < 1 ? 1 : shardTotal;
+        shards = new Shard[shardCount];
+    }
+
+    SessionManager(const SessionManager&) = delete;
+    SessionManager& operator=(const SessionManager&) = delete;
+
+    // Returns the user's session, creating it on first login. Only call this from
+    // the thread that owns the session (or before posting work for it).
+    Session& open(string_view email) {
+        Shard& shard = shardFor(email);
+        lock_guard<mutex> guard(shard.lock);
+        return *openLocked(shard, email);
+    }
+
+    void post(string_view email, function<void(Session&)> work) {
+        Shard& shard = shardFor(email);
+        lock_guard<mutex> guard(shard.lock);
+        if (!shard.worker.joinable()) shard.worker = thread(runWorker, &shard);
+
+        Task task;
+        task.session = openLocked(shard, email);
+        task.work = std::move(work);
+        shard.tasks.push(std::move(task));
+        shard.pending++;
+        shard.wake.notify_one();
+    }
+
+    // Blocks until every posted task has finished.
+    void drain() {
+        for (int i = 0; i < shardCount; i++) {
+            unique_lock<mutex> guard(shards[i].lock);
+            shards[i].idle.wait(guard, [&] { return shards[i].pending == 0; });
+        }
+    }
+
+    int getShardCount() { return shardCount; }
+
+    void forEach(function<void(Session&)> visit) {
+        for (int i = 0; i < shardCount; i++) {
+            lock_guard<mutex> guard(shards[i].lock);
+            for (int j = 0; j < (int)shards[i].owned.size(); j++) visit(*shards[i].owned[j]);
+        }
+    }
+
+    ~SessionManager() {
+        for (int i = 0; i < shardCount; i++) {
+            {
+                lock_guard<mutex> guard(shards[i].lock);
+                shards[i].stopping = true;
+            }
+            shards[i].wake.notify_one();
+            if (shards[i].worker.joinable()) shards[i].worker.join();
+            for (int j = 0; j < (int)shards[i].owned.size(); j++) delete shards[i].owned[j];
+        }
+        delete[] shards;
+    }
+};
+
+// --------------------- Byte Encoding ---------------------
+// Little helpers for the journal and snapshot formats: fixed-width native-endian
+// integers and length-prefixed strings.
+class ByteWriter {
+private:
+    vector<char> bytes;
+
+public:
+    void putRaw(const void* data, size_t length) {
+        const char* start = (const char*)data;
+        bytes.insert(bytes.end(), start, start + length);
+    }
+
+    void putInt32(int32_t value) { putRaw(&value, sizeof(value)); }
+    void putUint32(uint32_t value) { putRaw(&value, sizeof(value)); }
+    void putUint64(uint64_t value) { putRaw(&value, sizeof(value)); }
+    void putInt64(int64_t value) { putRaw(&value, sizeof(value)); }
+
+    void putString(string_view value) {
+        putUint32((uint32_t)value.size());
+        putRaw(value.data(), value.size());
+    }
+
+    const char* data() { return bytes.data(); }
+    size_t size() { return bytes.size(); }
+    void clear() { bytes.clear(); }
+};
+
+// Reads what ByteWriter wrote. Reading past the end sets a failure flag and
+// returns zeros instead of touching memory outside the buffer.
+class ByteReader {
+private:
+    const char* position;
+    const char* end;
+    bool failed;
+
+    bool take(void* out, size_t length) {
+        if (failed || (size_t)(end - position) < length) {
+            failed = true;
+            memset(out, 0, length);
+            return false;
+        }
+        memcpy(out, position, length);
+        position += length;
+        return true;
+    }
+
+public:
+    ByteReader(const char* data, size_t length) {
+        position = data;
+        end = data + length;
+        failed = false;
+    }
+
+    int32_t getInt32() { int32_t value; take(&value, sizeof(value)); return value; }
+    uint32_t getUint32() { uint32_t value; take(&value, sizeof(value)); return value; }
+    uint64_t getUint64() { uint64_t value; take(&value, sizeof(value)); return value; }
+    int64_t getInt64() { int64_t value; take(&value, sizeof(value)); return value; }
+
+    string_view getString() {
+        uint32_t length = getUint32();
+        if (failed || (size_t)(end - position) < length) {
+            failed = true;
+            return string_view();
+        }
+        string_view value(position, length);
+        position += length;
+        return value;
+    }
+
+    bool ok() { return !failed; }
+    bool atEnd() { return position == end; }
+};
+
+uint32_t checksumBytes(const char* data, size_t length) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// --------------------- Write-Ahead Log ---------------------
+// Append-only record log. Each record is
+//   [payload length u32][sequence u64][type u8][payload][checksum u32]
+// Appends are buffered in memory. commit() writes and fsyncs them once groupSize
+// records are pending, so one fsync covers the whole group; a background flusher
+// writes anything left pending after maxDelay, which bounds how long a committed
+// record can stay only in memory. sync() and syncThrough() force a flush for
+// records that must be on disk before they are acknowledged.
+// A failed write is cut back off the file so no torn record is left for later
+// records to sit behind, and the records in that group are dropped. Callers
+// learn of it from syncThrough() for their own records, or from the next
+// commit() for records that were flushed in the background.
+class WriteAheadLog {
+private:
+    static const size_t RECORD_OVERHEAD = 4 + 8 + 1 + 4;
+
+    mutex lock;
+    condition_variable flushWanted;
+    FILE* file;
+    long long fileSize;
+    vector<char> buffer;
+    int pendingRecords;
+    int groupSize;
+    chrono::milliseconds maxDelay;
+    chrono::steady_clock::time_point oldestPending;
+    uint64_t nextSequence;
+    vector<pair<uint64_t, uint64_t>> lostRanges;
+    bool lossUnreported;
+    bool stopping;
+    thread flusher;
+
+    bool flushLocked() {
+        if (pendingRecords == 0) return true;
+        bool written = file != NULL && fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size() && syncFile(file);
+        if (written) {
+            fileSize += (long long)buffer.size();
+        } else {
+            if (file != NULL) cutFile(file, fileSize);
+            lostRanges.push_back(make_pair(nextSequence - pendingRecords, nextSequence - 1));
+            lossUnreported = true;
+        }
+        buffer.clear();
+        pendingRecords = 0;
+        return written;
+    }
+
+    void runFlusher() {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            if (pendingRecords == 0) {
+                flushWanted.wait(guard);
+                continue;
+            }
+            chrono::steady_clock::time_point due = oldestPending + maxDelay;
+            if (chrono::steady_clock::now() < due) {
+                flushWanted.wait_until(guard, due);
+                continue;
+            }
+            flushLocked();
+        }
+    }
+
+    void stopFlusher() {
+        if (!flusher.joinable()) return;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        flushWanted.notify_all();
+        flusher.join();
+        stopping = false;
+    }
+
+public:
+    WriteAheadLog() {
+        file = NULL;
+        fileSize = 0;
+        pendingRecords = 0;
+        groupSize = 1;
+        maxDelay = chrono::milliseconds(0);
+        nextSequence = 1;
+        lossUnreported = false;
+        stopping = false;
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    bool open(const string& path, uint64_t firstSequence, int recordsPerGroup = 1,
+              chrono::milliseconds flushDelay = chrono::milliseconds(0)) {
+        close();
+        lock_guard<mutex> guard(lock);
+        file = fopen(path.c_str(), "ab");
+        fileSize = 0;
+        // Records are buffered here; stdio keeping its own copy would make a failed
+        // write impossible to take back.
+        if (file != NULL) setvbuf(file, NULL, _IONBF, 0);
+        if (file != NULL && fseek(file, 0, SEEK_END) == 0) fileSize = ftell(file);
+        nextSequence = firstSequence;
+        groupSize = recordsPerGroup < 1 ? 1 : recordsPerGroup;
+        maxDelay = flushDelay;
+        if (file != NULL && groupSize > 1 && maxDelay.count() > 0) flusher = thread(&WriteAheadLog::runFlusher, this);
+        return file != NULL;
+    }
+
+    uint64_t append(unsigned char type, ByteWriter& payload) {
+        lock_guard<mutex> guard(lock);
+        uint64_t sequence = nextSequence++;
+        uint32_t length = (uint32_t)payload.size();
+
+        size_t start = buffer.size();
+        buffer.resize(start + RECORD_OVERHEAD + length);
+        char* record = buffer.data() + start;
+        memcpy(record, &length, 4);
+        memcpy(record + 4, &sequence, 8);
+        record[12] = (char)type;
+        if (length > 0) memcpy(record + 13, payload.data(), length);
+        uint32_t checksum = checksumBytes(record + 4, 9 + length);
+        memcpy(record + 13 + length, &checksum, 4);
+
+        if (pendingRecords++ == 0) {
+            oldestPending = chrono::steady_clock::now();
+            if (flusher.joinable()) flushWanted.notify_one();
+        }
+        return sequence;
+    }
+
+    // Returns false if this flush, or a background flush since the last call,
+    // failed and dropped records.
+    bool commit() {
+        lock_guard<mutex> guard(lock);
+        if (file != NULL && pendingRecords >= groupSize) flushLocked();
+        bool healthy = !lossUnreported;
+        lossUnreported = false;
+        return healthy;
+    }
+
+    bool sync() {
+        lock_guard<mutex> guard(lock);
+        if (file == NULL) return false;
+        return flushLocked();
+    }
+
+    // Flushes, then reports whether every record in [first, last] reached disk.
+    bool syncThrough(uint64_t first, uint64_t last) {
+        lock_guard<mutex> guard(lock);
+        if (file == NULL) return false;
+        flushLocked();
+        for (size_t i = 0; i < lostRanges.size(); i++) {
+            if (lostRanges[i].first <= last && first <= lostRanges[i].second) return false;
+        }
+        return true;
+    }
+
+    uint64_t lastSequence() {
+        lock_guard<mutex> guard(lock);
+        return nextSequence - 1;
+    }
+
+    // Drops everything logged so far; used once a snapshot covers it.
+    bool truncate(const string& path) {
+        lock_guard<mutex> guard(lock);
+        if (file != NULL) fclose(file);
+        buffer.clear();
+        pendingRecords = 0;
+        fileSize = 0;
+        file = fopen(path.c_str(), "wb");
+        if (file != NULL) setvbuf(file, NULL, _IONBF, 0);
+        return file != NULL && syncFile(file);
+    }
+
+    void close() {
+        stopFlusher();
+        lock_guard<mutex> guard(lock);
+        if (file == NULL) return;
+        flushLocked();
+        fclose(file);
+        file = NULL;
+    }
+
+    // Calls apply for every intact record in order and returns the last sequence
+    // seen. A torn or corrupt tail (from a crash mid-write) is cut off the file.
+    static uint64_t replay(const string& path, function<void(uint64_t, unsigned char, ByteReader&)> apply) {
+        ifstream in(path, ios::binary);
+        if (!in) return 0;
+        vector<char> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        in.close();
+
+        uint64_t lastSequence = 0;
+        size_t offset = 0;
+        while (bytes.size() - offset >= RECORD_OVERHEAD) {
+            const char* record = bytes.data() + offset;
+            uint32_t length, checksum;
+            memcpy(&length, record, 4);
+            if (bytes.size() - offset - RECORD_OVERHEAD < length) break;
+            memcpy(&checksum, record + 13 + length, 4);
+            if (checksum != checksumBytes(record + 4, 9 + length)) break;
+
+            uint64_t sequence;
+            memcpy(&sequence, record + 4, 8);
+            ByteReader payload(record + 13, length);
+            apply(sequence, (unsigned char)record[12], payload);
+            lastSequence = sequence;
+            offset += RECORD_OVERHEAD + length;
+        }
+
+        if (offset < bytes.size()) {
+            ofstream out(path, ios::binary | ios::trunc);
+            out.write(bytes.data(), (streamsize)offset);
+        }
+        return lastSequence;
+    }
+
+    ~WriteAheadLog() {
+        close();
+    }
+};
+
+// --------------------- Store Journal ---------------------
+// Makes orders, stock and carts survive a crash. Every change is logged to the
+// write-ahead log before it is acknowledged. A snapshot writes the catalog file
+// and store.snap (orders and carts), each stamped with the last journal sequence it
+// covers, and then empties the log. On startup the snapshots are loaded and only
+// newer journal records are replayed on top.
+const char* CATALOG_PATH = "catalog.bin";
+const char* STORE_SNAPSHOT_PATH = "store.snap";
+const char* JOURNAL_PATH = "journal.wal";
+const char STORE_SNAPSHOT_MAGIC[8] = {'S', 'H', 'O', 'P', 'S', 'N', 'P', '6'};
+
+enum JournalRecordType {
+    JOURNAL_PRODUCT_ADD = 1,
+    JOURNAL_PRODUCT_REMOVE = 2,
+    JOURNAL_STOCK_SET = 3,
+    JOURNAL_CART_LINE = 4,
+    JOURNAL_CHECKOUT = 5,
+    JOURNAL_PRICE_SET = 6
+};
+
+class StoreJournal {
+private:
+    static const int SNAPSHOT_EVERY = 10000;
+    // Cart and admin changes are fsynced in groups of up to GROUP_SIZE records and
+    // reach disk at most FLUSH_DELAY_MS after they are logged. Checkouts are
+    // always flushed before they are acknowledged.
+    static constexpr int GROUP_SIZE = 64;
+    static constexpr int FLUSH_DELAY_MS = 5;
+
+    WriteAheadLog wal;
+    atomic<int> recordsSinceSnapshot;
+    uint64_t catalogSequence;
+    string catalogPath;
+    string snapshotPath;
+    string journalPath;
+
+    bool log(unsigned char type, ByteWriter& payload) {
+        wal.append(type, payload);
+        recordsSinceSnapshot++;
+        return wal.commit();
+    }
+
+    static void putLines(ByteWriter& out, MyLinkedList& items) {
+        out.putInt32(items.size());
+        for (CartItem* temp = items.getHead(); temp != NULL; temp = temp->next) {
+            Product* product = temp->product.get();
+            out.putInt32(product == NULL ? -1 : product->getId());
+            out.putInt32(temp->quantity);
+        }
+    }
+
+    static void getLines(ByteReader& in, Catalog& catalog, MyLinkedList& items) {
+        int lineCount = in.getInt32();
+        for (int i = 0; i < lineCount && in.ok(); i++) {
+            int productId = in.getInt32();
+            int quantity = in.getInt32();
+            ProductHandle product = catalog.find(productId);
+            if (product.get() != NULL && quantity > 0) items.add(product, quantity);
+        }
+    }
+
+    static void putOrderLines(ByteWriter& out, Order& order) {
+        const OrderLine* lines = order.getLines();
+        out.putInt32(order.getLineCount());
+        for (int i = 0; i < order.getLineCount(); i++) {
+            Product* product = lines[i].product.get();
+            out.putInt32(product == NULL ? -1 : product->getId());
+            out.putInt32(lines[i].quantity);
+            out.putInt64(lines[i].unitPriceCents);
+            out.putInt64(lines[i].chargedCents);
+            out.putString(lines[i].name);
+        }
+    }
+
+    // Lines whose product is gone keep their name, quantity and price, with an
+    // empty handle.
+    static void getOrderLines(ByteReader& in, Catalog& catalog, vector<OrderLine>& lines) {
+        int lineCount = in.getInt32();
+        for (int i = 0; i < lineCount && in.ok(); i++) {
+            int productId = in.getInt32();
+            int quantity = in.getInt32();
+            long long unitPrice = in.getInt64();
+            long long charged = in.getInt64();
+            string_view name = in.getString();
+            if (!in.ok() || quantity <= 0) continue;
+            ProductHandle product = productId < 0 ? ProductHandle() : catalog.find(productId);
+            Product* found = product.get();
+            name = found != NULL && found->getName() == name ? found->getName() : catalog.storeName(name);
+            lines.push_back(OrderLine{product, quantity, unitPrice, charged, name});
+        }
+    }
+
+    static bool loadStoreSnapshot(const string& path, Catalog& catalog, SessionManager& sessions,
+                                  MyQueue<Order>& orders, int& orderCounter, uint64_t& sequence) {
+        ifstream in(path, ios::binary);
+        if (!in) return false;
+        vector<char> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        if (bytes.size() < 12 || memcmp(bytes.data(), STORE_SNAPSHOT_MAGIC, 8) != 0) return false;
+
+        uint32_t checksum;
+        memcpy(&checksum, bytes.data() + bytes.size() - 4, 4);
+        if (checksum != checksumBytes(bytes.data(), bytes.size() - 4)) return false;
+
+        ByteReader snapshot(bytes.data() + 8, bytes.size() - 12);
+        sequence = snapshot.getUint64();
+        orderCounter = snapshot.getInt32();
+
+        int orderCount = snapshot.getInt32();
+        for (int i = 0; i < orderCount && snapshot.ok(); i++) {
+            int orderId = snapshot.getInt32();
+            long long total = snapshot.getInt64();
+            long long placedAt = snapshot.getInt64();
+            vector<OrderLine> lines;
+            getOrderLines(snapshot, catalog, lines);
+            orders.push(Order(orderId, lines, total, placedAt));
+        }
+
+        int cartCount = snapshot.getInt32();
+        for (int i = 0; i < cartCount && snapshot.ok(); i++) {
+            string_view email = snapshot.getString();
+            MyLinkedList items;
+            getLines(snapshot, catalog, items);
+            Cart& cart = sessions.open(email).cart;
+            for (CartItem* temp = items.getHead(); temp != NULL; temp = temp->next) {
+                cart.restoreLine(temp->product, temp->quantity);
+            }
+        }
+        return snapshot.ok();
+    }
+
+public:
+    // The store's files are pathPrefix followed by catalog.bin, store.snap and
+    // journal.wal.
+    StoreJournal(const string& pathPrefix = "")
+        : catalogPath(pathPrefix + CATALOG_PATH), snapshotPath(pathPrefix + STORE_SNAPSHOT_PATH),
+          journalPath(pathPrefix + JOURNAL_PATH) {
+        recordsSinceSnapshot = 0;
+        catalogSequence = 0;
+    }
+
+    // Loads the catalog snapshot. Returns false if there is none, in which case the
+    // caller seeds the catalog before calling recover().
+    bool loadCatalog(Catalog& catalog) {
+        CatalogFile* catalogFile = new CatalogFile();
+        if (!catalogFile->open(catalogPath)) {
+            delete catalogFile;
+            return false;
+        }
+        catalogSequence = catalogFile->getJournalSequence();
+        CatalogFile::loadInto(catalogFile, catalog);
+        return true;
+    }
+
+    // Loads orders and carts from the last snapshot, replays the journal on top and
+    // opens it for appending.
+    // Returns false if the journal could not be opened for writing.
+    bool recover(Catalog& catalog, SessionManager& sessions, MyQueue<Order>& orders, int& orderCounter) {
+        uint64_t storeSequence = 0;
+        loadStoreSnapshot(snapshotPath, catalog, sessions, orders, orderCounter, storeSequence);
+
+        uint64_t lastSequence = WriteAheadLog::replay(journalPath,
+            [&, this](uint64_t sequence, unsigned char type, ByteReader& in) {
+                bool catalogNewer = sequence > catalogSequence;
+                bool storeNewer = sequence > storeSequence;
+
+                if (type == JOURNAL_PRODUCT_ADD && catalogNewer) {
+                    int id = in.getInt32();
+                    string_view name = in.getString();
+                    string_view category = in.getString();
+                    long long price = in.getInt64();
+                    int stock = in.getInt32();
+                    if (in.ok()) catalog.add(Product(id, name, category, price, stock));
+                } else if (type == JOURNAL_PRODUCT_REMOVE && catalogNewer) {
+                    catalog.remove(in.getInt32());
+                } else if (type == JOURNAL_STOCK_SET && catalogNewer) {
+                    Product* product = catalog.find(in.getInt32()).get();
+                    int stock = in.getInt32();
+                    if (product != NULL && in.ok()) product->setStock(stock);
+                } else if (type == JOURNAL_PRICE_SET && catalogNewer) {
+                    int id = in.getInt32();
+                    long long price = in.getInt64();
+                    if (in.ok()) catalog.setPrice(id, price);
+                } else if (type == JOURNAL_CART_LINE && storeNewer) {
+                    string_view email = in.getString();
+                    ProductHandle product = catalog.find(in.getInt32());
+                    int quantity = in.getInt32();
+                    if (in.ok()) sessions.open(email).cart.restoreLine(product, quantity);
+                } else if (type == JOURNAL_CHECKOUT) {
+                    string_view email = in.getString();
+                    int orderId = in.getInt32();
+                    long long total = in.getInt64();
+                    long long placedAt = in.getInt64();
+                    vector<OrderLine> lines;
+                    getOrderLines(in, catalog, lines);
+                    if (!in.ok()) return;
+
+                    if (catalogNewer) {
+                        for (size_t i = 0; i < lines.size(); i++) {
+                            Product* product = lines[i].product.get();
+                            if (product != NULL) product->setStock(product->getStock() - lines[i].quantity);
+                        }
+                    }
+                    if (storeNewer) {
+                        orders.push(Order(orderId, lines, total, placedAt));
+                        if (orderId >= orderCounter) orderCounter = orderId + 1;
+                        sessions.open(email).cart.clear();
+                    }
+                }
+            });
+
+        uint64_t nextSequence = max(lastSequence, max(catalogSequence, storeSequence)) + 1;
+        return wal.open(journalPath, nextSequence, GROUP_SIZE, chrono::milliseconds(FLUSH_DELAY_MS));
+    }
+
+    bool logProductAdded(Product& product) {
+        ByteWriter payload;
+        payload.putInt32(product.getId());
+        payload.putString(product.getName());
+        payload.putString(product.getCategory());
+        payload.putInt64(product.getPriceCents());
+        payload.putInt32(product.getStock());
+        return log(JOURNAL_PRODUCT_ADD, payload);
+    }
+
+    bool logProductRemoved(int productId) {
+        ByteWriter payload;
+        payload.putInt32(productId);
+        return log(JOURNAL_PRODUCT_REMOVE, payload);
+    }
+
+    bool logStockSet(int productId, int stock) {
+        ByteWriter payload;
+        payload.putInt32(productId);
+        payload.putInt32(stock);
+        return log(JOURNAL_STOCK_SET, payload);
+    }
+
+    bool logPriceSet(int productId, long long priceCents) {
+        ByteWriter payload;
+        payload.putInt32(productId);
+        payload.putInt64(priceCents);
+        return log(JOURNAL_PRICE_SET, payload);
+    }
+
+    bool logCartLine(string_view email, ProductHandle handle, int quantity) {
+        Product* product = handle.get();
+        if (product == NULL) return true;
+        ByteWriter payload;
+        payload.putString(email);
+        payload.putInt32(product->getId());
+        payload.putInt32(quantity);
+        return log(JOURNAL_CART_LINE, payload);
+    }
+
+    // Returns only once the record is on disk; false if it could not be written.
+    bool logCheckout(string_view email, Order& order) {
+        uint64_t sequence = appendCheckout(email, order);
+        return wal.syncThrough(sequence, sequence);
+    }
+
+    // Group commit: appendCheckout only buffers the record and returns its
+    // sequence; syncCheckouts flushes everything buffered with one fsync and
+    // says whether the records in [first, last] made it.
+    uint64_t appendCheckout(string_view email, Order& order) {
+        ByteWriter payload;
+        payload.putString(email);
+        payload.putInt32(order.getOrderId());
+        payload.putInt64(order.getTotalCents());
+        payload.putInt64(order.getPlacedAt());
+        putOrderLines(payload, order);
+        recordsSinceSnapshot++;
+        return wal.append(JOURNAL_CHECKOUT, payload);
+    }
+
+    bool syncCheckouts(uint64_t first, uint64_t last) { return wal.syncThrough(first, last); }
+
+    bool syncLog() { return wal.sync(); }
+
+    // Starts an empty log at path without loading any snapshot; for benchmarks.
+    bool openEmpty(const char* path, int groupSize = 1, int flushDelayMs = 0) {
+        ::remove(path);
+        return wal.open(path, 1, groupSize, chrono::milliseconds(flushDelayMs));
+    }
+
+    bool snapshotDue() { return recordsSinceSnapshot >= SNAPSHOT_EVERY; }
+
+    bool snapshot(Catalog& catalog, SessionManager& sessions, MyQueue<Order>& orders, int orderCounter) {
+        if (!wal.sync()) return false;
+        uint64_t sequence = wal.lastSequence();
+        if (!CatalogFile::write(catalog, catalogPath, sequence)) return false;
+
+        ByteWriter snapshot;
+        snapshot.putRaw(STORE_SNAPSHOT_MAGIC, 8);
+        snapshot.putUint64(sequence);
+        snapshot.putInt32(orderCounter);
+        snapshot.putInt32(orders.size());
+        for (int i = 0; i < orders.size(); i++) {
+            Order& order = orders.at(i);
+            snapshot.putInt32(order.getOrderId());
+            snapshot.putInt64(order.getTotalCents());
+            snapshot.putInt64(order.getPlacedAt());
+            putOrderLines(snapshot, order);
+        }
+
+        int cartCount = 0;
+        sessions.forEach([&cartCount](Session& session) {
+            if (session.cart.getItems().size() > 0) cartCount++;
+        });
+        snapshot.putInt32(cartCount);
+        sessions.forEach([&snapshot](Session& session) {
+            if (session.cart.getItems().size() == 0) return;
+            snapshot.putString(session.email);
+            putLines(snapshot, session.cart.getItems());
+        });
+        snapshot.putUint32(checksumBytes(snapshot.data(), snapshot.size()));
+
+        string tempPath = snapshotPath + ".tmp";
+        FILE* out = fopen(tempPath.c_str(), "wb");
+        if (out == NULL) return false;
+        bool written = fwrite(snapshot.data(), 1, snapshot.size(), out) == snapshot.size() && syncFile(out);
+        fclose(out);
+        if (!written || !replaceFile(tempPath, snapshotPath)) return false;
+
+        recordsSinceSnapshot = 0;
+        return wal.truncate(journalPath);
+    }
+};
+
+void reportJournalFailure() {
+    cout << "Warning: the journal could not be written; recent changes may be lost on restart.\n";
+}
+
+// --------------------- Order Analytics ---------------------
+// Sales aggregated over a set of orders: revenue per category code, units per
+// product id and units per time window (window index = placedAt / windowSeconds).
+// Lines whose product has since been removed count toward unavailableRevenue.
+struct SalesTotals {
+    long long windowSeconds;
+    long long orderCount;
+    long long revenueCents;
+    long long unavailableRevenue;
+    vector<long long> revenueByCategory;
+    MyHashMap<int, long long> unitsByProduct;
+    MyHashMap<long long, long long> unitsByWindow;
+
+    SalesTotals(long long window = 3600) {
+        windowSeconds = window < 1 ? 1 : window;
+        orderCount = 0;
+        revenueCents = 0;
+        unavailableRevenue = 0;
+    }
+
+    void addOrder(Order& order, CategoryDictionary& categories) {
+        orderCount++;
+        revenueCents += order.getTotalCents();
+        long long window = order.getPlacedAt() / windowSeconds;
+        const OrderLine* lines = order.getLines();
+        for (int i = 0; i < order.getLineCount(); i++) {
+            long long lineRevenue = lines[i].chargedCents;
+            Product* product = lines[i].product.get();
+            if (product == NULL) {
+                unavailableRevenue += lineRevenue;
+                continue;
+            }
+            int code = categories.find(product->getCategory());
+            if (code >= (int)revenueByCategory.size()) revenueByCategory.resize(code + 1, 0);
+            revenueByCategory[code] += lineRevenue;
+            addUnits(unitsByProduct, product->getId(), lines[i].quantity);
+            addUnits(unitsByWindow, window, lines[i].quantity);
+        }
+    }
+
+    void merge(SalesTotals& other) {
+        orderCount += other.orderCount;
+        revenueCents += other.revenueCents;
+        unavailableRevenue += other.unavailableRevenue;
+        if (other.revenueByCategory.size() > revenueByCategory.size()) {
+            revenueByCategory.resize(other.revenueByCategory.size(), 0);
+        }
+        for (size_t i = 0; i < other.revenueByCategory.size(); i++) revenueByCategory[i] += other.revenueByCategory[i];
+        other.unitsByProduct.forEach([this](int id, long long units) { addUnits(unitsByProduct, id, units); });
+        other.unitsByWindow.forEach([this](long long window, long long units) { addUnits(unitsByWindow, window, units); });
+    }
+
+    // Product ids with the most units sold, best first.
+    vector<pair<int, long long>> topProducts(int limit) {
+        vector<pair<int, long long>> ranked;
+        ranked.reserve(unitsByProduct.size());
+        unitsByProduct.forEach([&ranked](int id, long long units) { ranked.push_back(make_pair(id, units)); });
+        size_t keep = min((size_t)max(limit, 0), ranked.size());
+        partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(),
+                     [](const pair<int, long long>& a, const pair<int, long long>& b) {
+                         return a.second != b.second ? a.second > b.second : a.first < b.first;
+                     });
+        ranked.resize(keep);
+        return ranked;
+    }
+
+    template <typename K>
+    static void addUnits(MyHashMap<K, long long>& map, K key, long long units) {
+        long long* current = map.find(key);
+        if (current != NULL) *current += units;
+        else map.insert(key, units);
+    }
+};
+
+// Aggregates every order in the queue across threadCount threads (0 = one per
+// core). Threads claim fixed-size chunks of the queue from a shared counter,
+// so a slow chunk doesn't hold the others up, and each fills its own partial
+// totals; the partials are merged once all threads are done. Orders and the
+// catalog must not change during the scan.
+SalesTotals analyzeOrders(MyQueue<Order>& orders, Catalog& catalog, long long windowSeconds, int threadCount = 0) {
+    const int CHUNK_SIZE = 4096;
+    if (threadCount <= 0) threadCount = max(1, (int)thread::hardware_concurrency());
+    int chunkCount = (orders.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    threadCount = max(1, min(threadCount, chunkCount));
+
+    vector<SalesTotals> partials(threadCount, SalesTotals(windowSeconds));
+    atomic<int> nextChunk(0);
+    CategoryDictionary& categories = catalog.getCategories();
+    auto work = [&](int worker) {
+        SalesTotals& partial = partials[worker];
+        while (true) {
+            int chunk = nextChunk.fetch_add(1, memory_order_relaxed);
+            if (chunk >= chunkCount) return;
+            int end = min(orders.size(), (chunk + 1) * CHUNK_SIZE);
+            for (int i = chunk * CHUNK_SIZE; i < end; i++) partial.addOrder(orders.at(i), categories);
+        }
+    };
+
+    vector<thread> helpers;
+    for (int i = 1; i < threadCount; i++) helpers.push_back(thread(work, i));
+    work(0);
+    for (size_t i = 0; i < helpers.size(); i++) helpers[i].join();
+
+    for (int i = 1; i < threadCount; i++) partials[0].merge(partials[i]);
+    return std::move(partials[0]);
+}
+
+// Running totals over every order placed so far, kept current by recording each
+// checkout as it happens, so the admin report doesn't rescan the history.
+class SalesRollup {
+private:
+    Catalog& catalog;
+    SalesTotals totals;
+
+public:
+    SalesRollup(Catalog& storeCatalog, long long windowSeconds = 3600) : catalog(storeCatalog), totals(windowSeconds) {}
+
+    void rebuild(MyQueue<Order>& orders) { totals = analyzeOrders(orders, catalog, totals.windowSeconds); }
+    void recordOrder(Order& order) { totals.addOrder(order, catalog.getCategories()); }
+    SalesTotals& getTotals() { return totals; }
+};
+
+void renderSalesReport(OutputBuffer& out, SalesTotals& totals, Catalog& catalog, int topLimit) {
+    out.put("Orders: ").put(totals.orderCount).put(" Revenue: $").putMoney(totals.revenueCents).put('\n');
+
+    out.put("Revenue by category:\n");
+    CategoryDictionary& categories = catalog.getCategories();
+    for (size_t i = 0; i < totals.revenueByCategory.size(); i++) {
+        if (totals.revenueByCategory[i] == 0) continue;
+        out.put(" - ").put(categories.nameOf((int)i)).put(": $").putMoney(totals.revenueByCategory[i]).put('\n');
+    }
+    if (totals.unavailableRevenue != 0) {
+        out.put(" - (no longer available): $").putMoney(totals.unavailableRevenue).put('\n');
+    }
+
+    out.put("Top products:\n");
+    vector<pair<int, long long>> top = totals.topProducts(topLimit);
+    for (size_t i = 0; i < top.size(); i++) {
+        Product* product = catalog.find(top[i].first).get();
+        out.put(" - ").put(top[i].first).put(' ');
+        if (product != NULL) out.put(product->getName());
+        out.put(" x").put(top[i].second).put('\n');
+    }
+
+    out.put("Units sold per ").put(totals.windowSeconds / 60).put(" min window (UTC):\n");
+    vector<pair<long long, long long>> windows;
+    totals.unitsByWindow.forEach([&windows](long long window, long long units) { windows.push_back(make_pair(window, units)); });
+    sort(windows.begin(), windows.end());
+    for (size_t i = 0; i < windows.size(); i++) {
+        time_t start = (time_t)(windows[i].first * totals.windowSeconds);
+        char stamp[32] = "?";
+        tm* parts = gmtime(&start);
+        if (parts != NULL) strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", parts);
+        out.put(" - ").put(stamp).put(": ").put(windows[i].second).put('\n');
+    }
+}
+
+// --------------------- Pricing Rules ---------------------
+// Checkout pricing on top of list prices. Percentages are in basis points
+// (1/100 of a percent) and every step rounds down to whole cents:
+//   1. bundles: buy `buy` units of a product, pay for `pay` of them;
+//   2. percent off per category, on what is left of each line;
+//   3. a tiered discount on the cart, picked by its discounted lines total;
+//   4. tax per category on each line after its share of the tier discount.
+struct PricedLine {
+    int productId;
+    int categoryCode;
+    int quantity;
+    long long unitCents;
+    long long amountCents;  // after line discounts
+    long long chargedCents; // the line's share of the cart total, after tier discount and tax
+};
+
+struct PriceBreakdown {
+    long long subtotalCents; // list price
+    long long discountCents;
+    long long taxCents;
+    long long totalCents;
+};
+
+struct BundleDeal {
+    int buy;
+    int pay;
+};
+
+struct PricingRules {
+    vector<int> percentOffByCategory;
+    MyHashMap<int, BundleDeal> bundles;
+    vector<pair<long long, int>> tiers; // (minimum lines total, basis points), ascending
+    vector<int> taxByCategory;
+
+    static int byCategory(const vector<int>& table, int code) {
+        return code >= 0 && code < (int)table.size() ? table[code] : 0;
+    }
+
+    void setCategoryRate(vector<int>& table, int code, int basisPoints) {
+        if (code >= (int)table.size()) table.resize(code + 1, 0);
+        table[code] = basisPoints;
+    }
+
+    void addTier(long long minimumCents, int basisPoints) {
+        tiers.push_back(make_pair(minimumCents, basisPoints));
+        sort(tiers.begin(), tiers.end());
+    }
+
+    int tierFor(long long linesTotal) const {
+        int basisPoints = 0;
+        for (size_t i = 0; i < tiers.size() && tiers[i].first <= linesTotal; i++) basisPoints = tiers[i].second;
+        return basisPoints;
+    }
+
+    bool isEmpty() {
+        return bundles.size() == 0 && tiers.empty()
+               && all_of(percentOffByCategory.begin(), percentOffByCategory.end(), [](int v) { return v == 0; })
+               && all_of(taxByCategory.begin(), taxByCategory.end(), [](int v) { return v == 0; });
+    }
+};
+
+// Pipeline stages. A stage adjusts line amounts over a whole batch of lines at
+// once, and/or finishes one cart's breakdown; the pipeline below strings them
+// together at compile time, so there is no per-rule dispatch at run time.
+struct BundleStage {
+    static void applyLines(PricingRules& rules, PricedLine* lines, int count) {
+        if (rules.bundles.size() == 0) return;
+        for (int i = 0; i < count; i++) {
+            BundleDeal* deal = rules.bundles.find(lines[i].productId);
+            if (deal == NULL || deal->buy <= 0) continue;
+            long long freeUnits = (long long)(lines[i].quantity / deal->buy) * (deal->buy - deal->pay);
+            lines[i].amountCents -= freeUnits * lines[i].unitCents;
+        }
+    }
+    static void applyCart(PricingRules&, PricedLine*, int, PriceBreakdown&, int) {}
+};
+
+struct PercentOffStage {
+    static void applyLines(PricingRules& rules, PricedLine* lines, int count) {
+        if (rules.percentOffByCategory.empty()) return;
+        for (int i = 0; i < count; i++) {
+            int basisPoints = PricingRules::byCategory(rules.percentOffByCategory, lines[i].categoryCode);
+            lines[i].amountCents -= lines[i].amountCents * basisPoints / 10000;
+        }
+    }
+    static void applyCart(PricingRules&, PricedLine*, int, PriceBreakdown&, int) {}
+};
+
+struct TierStage {
+    static void applyLines(PricingRules&, PricedLine*, int) {}
+    static void applyCart(PricingRules&, PricedLine* lines, int count, PriceBreakdown& breakdown, int tierBasisPoints) {
+        long long linesTotal = breakdown.subtotalCents - breakdown.discountCents;
+        breakdown.discountCents += linesTotal * tierBasisPoints / 10000;
+        if (tierBasisPoints == 0) return;
+        for (int i = 0; i < count; i++) lines[i].chargedCents -= lines[i].amountCents * tierBasisPoints / 10000;
+    }
+};
+
+struct CategoryTaxStage {
+    static void applyLines(PricingRules&, PricedLine*, int) {}
+    static void applyCart(PricingRules& rules, PricedLine* lines, int count, PriceBreakdown& breakdown, int tierBasisPoints) {
+        if (rules.taxByCategory.empty()) return;
+        for (int i = 0; i < count; i++) {
+            int basisPoints = PricingRules::byCategory(rules.taxByCategory, lines[i].categoryCode);
+            long long taxable = lines[i].amountCents - lines[i].amountCents * tierBasisPoints / 10000;
+            long long tax = taxable * basisPoints / 10000;
+            breakdown.taxCents += tax;
+            lines[i].chargedCents += tax;
+        }
+    }
+};
+
+template <typename... Stages>
+class PricingPipeline {
+public:
+    // Prices cartCount carts whose lines sit back to back in `lines`; cart c owns
+    // lines[cartStarts[c] .. cartStarts[c + 1]). Line stages run over the whole
+    // batch before any cart is totalled. Each line's chargedCents ends up summing
+    // to the cart total; the cent lost to rounding the tier discount on the whole
+    // cart instead of per line goes to the cart's first line.
+    static void priceBatch(PricingRules& rules, PricedLine* lines, const int* cartStarts, int cartCount, PriceBreakdown* out) {
+        int lineCount = cartStarts[cartCount];
+        for (int i = 0; i < lineCount; i++) lines[i].amountCents = lines[i].unitCents * lines[i].quantity;
+        (Stages::applyLines(rules, lines, lineCount), ...);
+        for (int i = 0; i < lineCount; i++) lines[i].chargedCents = lines[i].amountCents;
+
+        for (int c = 0; c < cartCount; c++) {
+            PricedLine* cartLines = lines + cartStarts[c];
+            int count = cartStarts[c + 1] - cartStarts[c];
+            PriceBreakdown& breakdown = out[c];
+            breakdown.subtotalCents = 0;
+            breakdown.discountCents = 0;
+            breakdown.taxCents = 0;
+            long long linesTotal = 0;
+            for (int i = 0; i < count; i++) {
+                breakdown.subtotalCents += cartLines[i].unitCents * cartLines[i].quantity;
+                linesTotal += cartLines[i].amountCents;
+            }
+            breakdown.discountCents = breakdown.subtotalCents - linesTotal;
+            int tierBasisPoints = rules.tierFor(linesTotal);
+            (Stages::applyCart(rules, cartLines, count, breakdown, tierBasisPoints), ...);
+            breakdown.totalCents = breakdown.subtotalCents - breakdown.discountCents + breakdown.taxCents;
+            if (count == 0) continue;
+            long long charged = 0;
+            for (int i = 0; i < count; i++) charged += cartLines[i].chargedCents;
+            cartLines[0].chargedCents += breakdown.totalCents - charged;
+        }
+    }
+
+    static PriceBreakdown price(PricingRules& rules, PricedLine* lines, int count) {
+        int cartStarts[2] = {0, count};
+        PriceBreakdown breakdown;
+        priceBatch(rules, lines, cartStarts, 1, &breakdown);
+        return breakdown;
+    }
+};
+
+typedef PricingPipeline<BundleStage, PercentOffStage, TierStage, CategoryTaxStage> StandardPricing;
+
+// The same rules as a list of steps evaluated one at a time through a switch.
+// Each step does the same per-line lookups as the matching pipeline stage (the
+// bundle hash map, the per-category tables), so comparing the two measures the
+// cost of run-time dispatch rather than a different algorithm. Kept as the
+// reference the specialized pipeline is checked and benchmarked against.
+enum PricingRuleKind {
+    RULE_BUNDLE,
+    RULE_PERCENT_OFF,
+    RULE_TIER,
+    RULE_TAX
+};
+
+struct PricingRuleSpec {
+    PricingRuleKind kind;
+    PricingRules* rules;
+};
+
+// One step per kind of rule that is in use, in stage order.
+vector<PricingRuleSpec> flattenPricingRules(PricingRules& rules) {
+    vector<PricingRuleSpec> list;
+    auto anyRate = [](const vector<int>& table) { return any_of(table.begin(), table.end(), [](int v) { return v != 0; }); };
+    if (rules.bundles.size() > 0) list.push_back(PricingRuleSpec{RULE_BUNDLE, &rules});
+    if (anyRate(rules.percentOffByCategory)) list.push_back(PricingRuleSpec{RULE_PERCENT_OFF, &rules});
+    if (!rules.tiers.empty()) list.push_back(PricingRuleSpec{RULE_TIER, &rules});
+    if (anyRate(rules.taxByCategory)) list.push_back(PricingRuleSpec{RULE_TAX, &rules});
+    return list;
+}
+
+PriceBreakdown priceInterpreted(vector<PricingRuleSpec>& steps, PricedLine* lines, int count) {
+    PriceBreakdown breakdown = {0, 0, 0, 0};
+    for (int i = 0; i < count; i++) {
+        lines[i].amountCents = lines[i].unitCents * lines[i].quantity;
+        breakdown.subtotalCents += lines[i].amountCents;
+    }
+    long long linesTotal = -1;
+    int tierBasisPoints = 0;
+    for (size_t s = 0; s < steps.size(); s++) {
+        PricingRules& rules = *steps[s].rules;
+        if (steps[s].kind >= RULE_TIER && linesTotal < 0) {
+            linesTotal = 0;
+            for (int i = 0; i < count; i++) linesTotal += lines[i].amountCents;
+        }
+        switch (steps[s].kind) {
+            case RULE_BUNDLE:
+                for (int i = 0; i < count; i++) {
+                    BundleDeal* deal = rules.bundles.find(lines[i].productId);
+                    if (deal == NULL || deal->buy <= 0) continue;
+                    long long freeUnits = (long long)(lines[i].quantity / deal->buy) * (deal->buy - deal->pay);
+                    lines[i].amountCents -= freeUnits * lines[i].unitCents;
+                }
+                break;
+            case RULE_PERCENT_OFF:
+                for (int i = 0; i < count; i++) {
+                    int basisPoints = PricingRules::byCategory(rules.percentOffByCategory, lines[i].categoryCode);
+                    lines[i].amountCents -= lines[i].amountCents * basisPoints / 10000;
+                }
+                break;
+            case RULE_TIER:
+                tierBasisPoints = rules.tierFor(linesTotal);
+                break;
+            case RULE_TAX:
+                for (int i = 0; i < count; i++) {
+                    int basisPoints = PricingRules::byCategory(rules.taxByCategory, lines[i].categoryCode);
+                    long long taxable = lines[i].amountCents - lines[i].amountCents * tierBasisPoints / 10000;
+                    breakdown.taxCents += taxable * basisPoints / 10000;
+                }
+                break;
+        }
+    }
+    if (linesTotal < 0) {
+        linesTotal = 0;
+        for (int i = 0; i < count; i++) linesTotal += lines[i].amountCents;
+    }
+    breakdown.discountCents = breakdown.subtotalCents - linesTotal + linesTotal * tierBasisPoints / 10000;
+    breakdown.totalCents = breakdown.subtotalCents - breakdown.discountCents + breakdown.taxCents;
+    return breakdown;
+}
+
+// Turns a cart into priced lines. Lines whose product is gone are skipped.
+void gatherPricedLines(MyLinkedList& items, CategoryDictionary& categories, vector<PricedLine>& lines) {
+    for (CartItem* temp = items.getHead(); temp != NULL; temp = temp->next) {
+        Product* product = temp->product.get();
+        if (product == NULL) continue;
+        PricedLine line;
+        line.productId = product->getId();
+        line.categoryCode = categories.find(product->getCategory());
+        line.quantity = temp->quantity;
+        line.unitCents = product->getPriceCents();
+        line.amountCents = 0;
+        line.chargedCents = 0;
+        lines.push_back(line);
+    }
+}
+
+class PricingEngine {
+private:
+    Catalog& catalog;
+    PricingRules rules;
+    vector<PricedLine> scratch;
+
+public:
+    PricingEngine(Catalog& storeCatalog) : catalog(storeCatalog) {}
+
+    PricingRules& getRules() { return rules; }
+    bool hasRules() { return !rules.isEmpty(); }
+
+    PriceBreakdown priceCart(MyLinkedList& items) {
+        scratch.clear();
+        gatherPricedLines(items, catalog.getCategories(), scratch);
+        return StandardPricing::price(rules, scratch.data(), (int)scratch.size());
+    }
+
+    // The lines of the last priceCart call, one per cart line whose product exists.
+    const PricedLine* lastPricedLines() { return scratch.data(); }
+};
+
+void renderPriceBreakdown(OutputBuffer& out, PriceBreakdown& breakdown) {
+    out.put("Discounts: -$").putMoney(breakdown.discountCents)
+       .put(" Tax: $").putMoney(breakdown.taxCents)
+       .put(" Total: $").putMoney(breakdown.totalCents).put('\n');
+}
+
+// --------------------- Checkout ---------------------
+// Reserves stock for the whole cart, records the order and empties the cart.
+// Returns false, after saying why, if the cart is empty or stock ran out.
+bool placeOrder(Cart& cart, string_view email, MyQueue<Order>& orders, int& orderCounter, StoreJournal& journal,
+                SalesRollup& rollup, PricingEngine& pricing) {
+    METRIC_TIME(METRIC_CHECKOUT);
+    if (cart.getItems().getHead() == NULL) {
+        cout << "Cart empty.\n";
+        return false;
+    }
+    StockReservation reservation(cart.getItems());
+    if (!reservation.isHeld()) {
+        Product* product = reservation.getFailedItem()->product.get();
+        cout << "Not enough stock for " << product->getName()
+             << ". Available: " << product->getStock() << '\n';
+        return false;
+    }
+    PriceBreakdown breakdown = pricing.priceCart(cart.getItems());
+    if (pricing.hasRules()) {
+        OutputBuffer out(cout);
+        renderPriceBreakdown(out, breakdown);
+    }
+    const PricedLine* priced = pricing.lastPricedLines();
+    vector<OrderLine> lines;
+    for (CartItem* temp = cart.getItems().getHead(); temp != NULL; temp = temp->next) {
+        Product* product = temp->product.get();
+        if (product == NULL) continue;
+        const PricedLine& line = priced[lines.size()];
+        lines.push_back(OrderLine{temp->product, temp->quantity, line.unitCents, line.chargedCents, product->getName()});
+    }
+    Order order(orderCounter, lines, breakdown.totalCents, (long long)time(NULL));
+    if (!journal.logCheckout(email, order)) {
+        cout << "Could not record the order in the journal; it was not placed.\n";
+        return false;
+    }
+    rollup.recordOrder(order);
+    orders.push(std::move(order));
+    reservation.commit();
+    orderCounter++;
+    cart.clear();
+    cout << "Order placed successfully!\n";
+    return true;
+}
+
+// --------------------- Checkout Pipeline ---------------------
+// Checkout as a chain of stages, each working on a batch of orders at a time:
+//   validate -> reserve stock -> price -> persist -> fulfil
+// Validation copies the cart in submit(), on the caller's thread; every later
+// stage has a thread of its own and passes batches on through a concurrent queue.
+// Reserving takes each product's stock once for the batch's whole demand, and
+// persisting writes the batch's checkout records with a single log flush. The
+// caller gets a future for the result and clears the cart once it is placed.
+// Orders, the order counter and the rollup belong to the pipeline while work is
+// in flight: call waitIdle() before reading them or taking a snapshot.
+enum CheckoutStatus {
+    CHECKOUT_PLACED,
+    CHECKOUT_EMPTY_CART,
+    CHECKOUT_OUT_OF_STOCK,
+    CHECKOUT_NOT_RECORDED // the journal write failed; stock was given back
+};
+
+struct CheckoutResult {
+    CheckoutStatus status;
+    int orderId;
+    PriceBreakdown breakdown;
+    string_view shortProduct; // name of the product that ran out
+    int available;
+    double latencyNanoseconds; // submit to completion
+};
+
+class CheckoutPipeline {
+private:
+    static const int MAX_BATCH = 64;
+    static const int QUEUE_CAPACITY = 1024;
+    static const int SPINS_BEFORE_SLEEP = 16;
+
+    struct Job {
+        string email;
+        vector<OrderLine> lines;
+        vector<PricedLine> priced;
+        Order order;
+        CheckoutResult result;
+        promise<CheckoutResult> completion;
+        chrono::steady_clock::time_point submittedAt;
+        uint64_t submittedTicks;
+    };
+
+    // The ring between two stages. An idle consumer yields a few times and then
+    // sleeps; producers only take the lock when someone is asleep.
+    class StageQueue {
+    private:
+        MyConcurrentQueue<Job*> ring;
+        mutex lock;
+        condition_variable ready;
+        atomic<int> sleepers;
+
+    public:
+        StageQueue() : ring(QUEUE_CAPACITY) { sleepers = 0; }
+
+        void push(Job* job) {
+            while (!ring.tryPush(job)) this_thread::yield();
+            atomic_thread_fence(memory_order_seq_cst);
+            if (sleepers.load() > 0) {
+                lock_guard<mutex> guard(lock);
+                ready.notify_one();
+            }
+        }
+
+        // Returns 0 only once stopping is set and the ring is empty.
+        int popBatch(Job** out, int maxItems, atomic<bool>& stopping) {
+            for (int i = 0; i < SPINS_BEFORE_SLEEP; i++) {
+                int count = ring.popBatch(out, maxItems);
+                if (count > 0) return count;
+                this_thread::yield();
+            }
+            unique_lock<mutex> guard(lock);
+            sleepers++;
+            atomic_thread_fence(memory_order_seq_cst);
+            int count;
+            while ((count = ring.popBatch(out, maxItems)) == 0 && !stopping) ready.wait(guard);
+            sleepers--;
+            return count;
+        }
+
+        void wakeAll() {
+            lock_guard<mutex> guard(lock);
+            ready.notify_all();
+        }
+    };
+
+    // One order line's claim on a product during reservation.
+    struct StockDemand {
+        Product* product;
+        int job;
+        int line;
+        bool held;
+    };
+
+    MyQueue<Order>& orders;
+    int& orderCounter;
+    StoreJournal& journal;
+    SalesRollup& rollup;
+    PricingEngine& pricing;
+    CategoryDictionary& categories;
+
+    StageQueue toReserve, toPrice, toPersist, toFulfil;
+    atomic<bool> stopping;
+    mutex idleLock;
+    condition_variable idle;
+    long long inFlight;
+    vector<thread> workers;
+
+    // Scratch space, each used by a single stage thread.
+    vector<StockDemand> demand;
+    vector<PricedLine> batchLines;
+    vector<int> cartStarts;
+    vector<int> pricedJobs;
+    vector<PriceBreakdown> breakdowns;
+
+    void runStage(StageQueue* in, void (CheckoutPipeline::*process)(Job**, int), StageQueue* out) {
+        Job* batch[MAX_BATCH];
+        int count;
+        while ((count = in->popBatch(batch, MAX_BATCH, stopping)) > 0) {
+            (this->*process)(batch, count);
+            if (out == NULL) continue;
+            for (int i = 0; i < count; i++) out->push(batch[i]);
+        }
+    }
+
+    // Every product is reserved once for the batch's total demand. When a product
+    // can't cover the whole batch its lines are reserved one at a time in
+    // submission order instead, and an order that comes up short gives back what
+    // it already holds.
+    void reserveBatch(Job** jobs, int count) {
+        demand.clear();
+        for (int j = 0; j < count; j++) {
+            for (size_t l = 0; l < jobs[j]->lines.size(); l++) {
+                Product* product = jobs[j]->lines[l].product.get();
+                if (product != NULL) demand.push_back(StockDemand{product, j, (int)l, false});
+            }
+        }
+        sort(demand.begin(), demand.end(), [](const StockDemand& a, const StockDemand& b) {
+            if (a.product != b.product) return less<Product*>()(a.product, b.product);
+            return a.job < b.job;
+        });
+
+        bool shortfall = false;
+        for (size_t start = 0, end; start < demand.size(); start = end) {
+            long long total = 0;
+            for (end = start; end < demand.size() && demand[end].product == demand[start].product; end++) {
+                total += jobs[demand[end].job]->lines[demand[end].line].quantity;
+            }
+            // A combined demand no int stock could cover goes line by line below.
+            bool covered = total <= numeric_limits<int>::max() && demand[start].product->reserveStock((int)total);
+            for (size_t i = start; i < end; i++) demand[i].held = covered;
+            if (!covered) shortfall = true;
+        }
+        if (!shortfall) return;
+
+        sort(demand.begin(), demand.end(), [](const StockDemand& a, const StockDemand& b) {
+            return a.job != b.job ? a.job < b.job : a.line < b.line;
+        });
+        for (size_t start = 0, end; start < demand.size(); start = end) {
+            Job* job = jobs[demand[start].job];
+            for (end = start; end < demand.size() && demand[end].job == demand[start].job; end++) {}
+
+            for (size_t i = start; i < end && job->result.status == CHECKOUT_PLACED; i++) {
+                if (demand[i].held) continue;
+                int quantity = job->lines[demand[i].line].quantity;
+                if (demand[i].product->reserveStock(quantity)) {
+                    demand[i].held = true;
+                    continue;
+                }
+                job->result.status = CHECKOUT_OUT_OF_STOCK;
+                job->result.shortProduct = demand[i].product->getName();
+                job->result.available = demand[i].product->getStock();
+            }
+            if (job->result.status == CHECKOUT_PLACED) continue;
+            for (size_t i = start; i < end; i++) {
+                if (demand[i].held) demand[i].product->releaseStock(job->lines[demand[i].line].quantity);
+            }
+        }
+    }
+
+    void priceBatch(Job** jobs, int count) {
+        batchLines.clear();
+        cartStarts.assign(1, 0);
+        pricedJobs.clear();
+        for (int j = 0; j < count; j++) {
+            if (jobs[j]->result.status != CHECKOUT_PLACED) continue;
+            batchLines.insert(batchLines.end(), jobs[j]->priced.begin(), jobs[j]->priced.end());
+            cartStarts.push_back((int)batchLines.size());
+            pricedJobs.push_back(j);
+        }
+        if (pricedJobs.empty()) return;
+        breakdowns.resize(pricedJobs.size());
+        StandardPricing::priceBatch(pricing.getRules(), batchLines.data(), cartStarts.data(), (int)pricedJobs.size(),
+                                    breakdowns.data());
+        for (size_t k = 0; k < pricedJobs.size(); k++) {
+            Job* job = jobs[pricedJobs[k]];
+            job->result.breakdown = breakdowns[k];
+            for (size_t l = 0; l < job->lines.size(); l++) job->lines[l].chargedCents = batchLines[cartStarts[k] + l].chargedCents;
+        }
+    }
+
+    // If the batch's records don't reach disk, none of its orders are placed: their
+    // stock goes back and their order ids are reused.
+    void persistBatch(Job** jobs, int count) {
+        long long placedAt = (long long)time(NULL);
+        int firstOrderId = orderCounter;
+        uint64_t first = 0, last = 0;
+        for (int j = 0; j < count; j++) {
+            Job* job = jobs[j];
+            if (job->result.status != CHECKOUT_PLACED) continue;
+            job->result.orderId = orderCounter++;
+            job->order = Order(job->result.orderId, job->lines, job->result.breakdown.totalCents, placedAt);
+            last = journal.appendCheckout(job->email, job->order);
+            if (first == 0) first = last;
+        }
+        if (first == 0 || journal.syncCheckouts(first, last)) return;
+
+        orderCounter = firstOrderId;
+        for (int j = 0; j < count; j++) {
+            Job* job = jobs[j];
+            if (job->result.status != CHECKOUT_PLACED) continue;
+            for (size_t l = 0; l < job->lines.size(); l++) {
+                Product* product = job->lines[l].product.get();
+                if (product != NULL) product->releaseStock(job->lines[l].quantity);
+            }
+            job->result.status = CHECKOUT_NOT_RECORDED;
+            job->result.orderId = 0;
+        }
+    }
+
+    void fulfilBatch(Job** jobs, int count) {
+        for (int j = 0; j < count; j++) {
+            Job* job = jobs[j];
+            if (job->result.status == CHECKOUT_PLACED) {
+                rollup.recordOrder(job->order);
+                orders.push(std::move(job->order));
+            }
+#ifndef SHOP_NO_METRICS
+            MetricsRegistry::record(METRIC_CHECKOUT, MetricClock::now() - job->submittedTicks);
+#endif
+            job->result.latencyNanoseconds =
+                (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - job->submittedAt).count();
+            job->completion.set_value(job->result);
+            delete job;
+        }
+        lock_guard<mutex> guard(idleLock);
+        inFlight -= count;
+        if (inFlight == 0) idle.notify_all();
+    }
+
+public:
+    CheckoutPipeline(Catalog& catalog, MyQueue<Order>& storeOrders, int& storeOrderCounter, StoreJournal& storeJournal,
+                     SalesRollup& storeRollup, PricingEngine& storePricing)
+        : orders(storeOrders), orderCounter(storeOrderCounter), journal(storeJournal), rollup(storeRollup),
+          pricing(storePricing), categories(catalog.getCategories()) {
+        stopping = false;
+        inFlight = 0;
+        workers.emplace_back(&CheckoutPipeline::runStage, this, &toReserve, &CheckoutPipeline::reserveBatch, &toPrice);
+        workers.emplace_back(&CheckoutPipeline::runStage, this, &toPrice, &CheckoutPipeline::priceBatch, &toPersist);
+        workers.emplace_back(&CheckoutPipeline::runStage, this, &toPersist, &CheckoutPipeline::persistBatch, &toFulfil);
+        workers.emplace_back(&CheckoutPipeline::runStage, this, &toFulfil, &CheckoutPipeline::fulfilBatch, (StageQueue*)NULL);
+    }
+
+    CheckoutPipeline(const CheckoutPipeline&) = delete;
+    CheckoutPipeline& operator=(const CheckoutPipeline&) = delete;
+
+    // Copies the cart's lines at their current prices and queues the order. The
+    // cart itself is not touched.
+    future<CheckoutResult> submit(MyLinkedList& items, string_view email) {
+        Job* job = new Job();
+        job->submittedAt = chrono::steady_clock::now();
+        job->submittedTicks = MetricClock::now();
+        job->email = string(email);
+        job->result = CheckoutResult{CHECKOUT_PLACED, 0, PriceBreakdown{0, 0, 0, 0}, string_view(), 0, 0};
+        for (CartItem* temp = items.getHead(); temp != NULL; temp = temp->next) {
+            Product* product = temp->product.get();
+            if (product == NULL) continue;
+            long long unitCents = product->getPriceCents();
+            job->lines.push_back(OrderLine{temp->product, temp->quantity, unitCents, unitCents * temp->quantity,
+                                           product->getName()});
+            job->priced.push_back(PricedLine{product->getId(), categories.find(product->getCategory()), temp->quantity,
+                                             unitCents, 0, 0});
+        }
+
+        future<CheckoutResult> completion = job->completion.get_future();
+        if (job->lines.empty()) {
+            job->result.status = CHECKOUT_EMPTY_CART;
+            job->completion.set_value(job->result);
+            delete job;
+            return completion;
+        }
+        {
+            lock_guard<mutex> guard(idleLock);
+            inFlight++;
+        }
+        toReserve.push(job);
+        return completion;
+    }
+
+    // Blocks until every submitted checkout has completed.
+    void waitIdle() {
+        unique_lock<mutex> guard(idleLock);
+        idle.wait(guard, [this] { return inFlight == 0; });
+    }
+
+    ~CheckoutPipeline() {
+        waitIdle();
+        stopping = true;
+        toReserve.wakeAll();
+        toPrice.wakeAll();
+        toPersist.wakeAll();
+        toFulfil.wakeAll();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    }
+};
+
+// Prints what placeOrder would have said about the same checkout.
+void printCheckoutResult(CheckoutResult& result, bool showBreakdown) {
+    if (result.status == CHECKOUT_EMPTY_CART) {
+        cout << "Cart empty.\n";
+    } else if (result.status == CHECKOUT_OUT_OF_STOCK) {
+        cout << "Not enough stock for " << result.shortProduct << ". Available: " << result.available << '\n';
+    } else if (result.status == CHECKOUT_NOT_RECORDED) {
+        cout << "Could not record the order in the journal; it was not placed.\n";
+    } else {
+        if (showBreakdown) {
+            OutputBuffer out(cout);
+            renderPriceBreakdown(out, result.breakdown);
+        }
+        cout << "Order placed successfully!\n";
+    }
+}
+
+// --------------------- Safe Input Functions ---------------------
+int getIntInput(const string& prompt) {
+    int value;
+    while (true) {
+        cout << prompt;
+        if (cin >> value) {
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            return value;
+        } else {
+            cout << "Invalid input, please enter a number.\n";
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        }
+    }
+}
+
+// Reads an amount such as "19.99" and returns it in cents.
+long long getMoneyInput(const string& prompt) {
+    string token;
+    long long cents;
+    while (true) {
+        cout << prompt;
+        if (cin >> token && parseCents(token, cents)) {
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            return cents;
+        } else {
+            cout << "Invalid input, please enter a number.\n";
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        }
+    }
+}
+
+// --------------------- Catalog Import ---------------------
+// Splits one CSV record. Quoted fields may contain commas and doubled quotes.
+vector<string> splitCsvLine(const string& line) {
+    vector<string> fields;
+    string field;
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                field += '"';
+                i++;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                field += c;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(field);
+            field.clear();
+        } else if (c != '\r') {
+            field += c;
+        }
+    }
+    fields.push_back(field);
+    return fields;
+}
+
+// Reads "id,name,category,price,stock" records (an optional header line is skipped).
+// Returns the number of malformed or duplicate lines, or -1 if the file can't be read.
+int importCatalogCsv(const string& path, Catalog& catalog) {
+    ifstream in(path);
+    if (!in) return -1;
+
+    int skipped = 0;
+    string line;
+    bool first = true;
+    while (getline(in, line)) {
+        if (line.empty() || line == "\r") continue;
+        vector<string> fields = splitCsvLine(line);
+        try {
+            if (fields.size() != 5) throw invalid_argument("field count");
+            int id = stoi(fields[0]);
+            long long price;
+            if (!parseCents(fields[3], price)) throw invalid_argument("price");
+            int stock = stoi(fields[4]);
+            if (catalog.add(Product(id, fields[1], fields[2], price, stock)).get() == NULL) skipped++;
+        } catch (const exception&) {
+            if (!first) skipped++;
+        }
+        first = false;
+    }
+    return skipped;
+}
+
+// --------------------- Batch Commands ---------------------
+// Splits a command line into whitespace-separated views of the line itself; a
+// token may be wrapped in double quotes to include spaces. Nothing is copied.
+class CommandTokenizer {
+private:
+    static const int MAX_TOKENS = 8;
+
+    string_view tokens[MAX_TOKENS];
+    int count;
+
+public:
+    CommandTokenizer() { count = 0; }
+
+    // Returns false if the line has more tokens than fit.
+    bool tokenize(string_view line) {
+        count = 0;
+        size_t i = 0;
+        while (true) {
+            while (i < line.size() && isspace((unsigned char)line[i])) i++;
+            if (i == line.size() || line[i] == '#') return true;
+            if (count == MAX_TOKENS) return false;
+
+            size_t start = i;
+            if (line[i] == '"') {
+                start = ++i;
+                while (i < line.size() && line[i] != '"') i++;
+                tokens[count++] = line.substr(start, i - start);
+                if (i < line.size()) i++;
+            } else {
+                while (i < line.size() && !isspace((unsigned char)line[i])) i++;
+                tokens[count++] = line.substr(start, i - start);
+            }
+        }
+    }
+
+    int size() { return count; }
+    string_view operator[](int index) { return index < count ? tokens[index] : string_view(); }
+};
+
+bool parseInt(string_view text, int& value) {
+    const char* end = text.data() + text.size();
+    from_chars_result result = from_chars(text.data(), end, value);
+    return !text.empty() && result.ec == errc() && result.ptr == end;
+}
+
+enum BatchCommand {
+    BATCH_REGISTER,
+    BATCH_LOGIN,
+    BATCH_LOGOUT,
+    BATCH_ADD,
+    BATCH_REMOVE,
+    BATCH_UNDO,
+    BATCH_REDO,
+    BATCH_BEGIN,
+    BATCH_COMMIT,
+    BATCH_CHECKOUT,
+    BATCH_UPDATE_STOCK,
+    BATCH_COMMAND_COUNT
+};
+
+const char* BATCH_COMMAND_NAMES[BATCH_COMMAND_COUNT] = {
+    "register", "login", "logout", "add", "remove", "undo", "redo", "begin", "commit", "checkout", "update-stock"
+};
+
+// Runs commands one per line against the same catalog, carts, orders and
+// journal as the menus:
+//   register <name> <email> <password>    login <email> <password>    logout
+//   add <productId> <qty>    remove <productId> <qty>    undo    redo
+//   begin    commit   (cart changes in between undo and redo as one step)
+//   checkout    update-stock <productId> <stock>   (admin only)
+// Command output goes to stdout; per-command counts, throughput and latency to
+// completion are reported to stderr at the end, so the mode doubles as a load
+// replay.
+// Cart commands and checkout submission run on the user's session worker, so
+// different users' commands run in parallel while each user's stay in order.
+// Checkouts then go through the pipeline, where checkouts from different users
+// are batched together. A user's next cart command waits for their own checkout
+// to finish. Output is printed in submission order as commands complete. Admin
+// changes and snapshots wait for everything in flight.
+class BatchRunner {
+private:
+    // A command handed to a session worker. The worker fills in the fields after
+    // done and then sets posted.
+    struct PendingCommand {
+        int lineNumber;
+        BatchCommand command;
+        string email;
+        chrono::steady_clock::time_point startedAt;
+        promise<void> posted;
+        future<void> done;
+        ostringstream output;
+        const char* failure;
+        future<CheckoutResult> result; // checkouts only
+        chrono::steady_clock::time_point finishedAt;
+    };
+
+    Catalog& catalog;
+    SessionManager& sessions;
+    MyQueue<Order>& orders;
+    int& orderCounter;
+    StoreJournal& journal;
+    UserDirectory& users;
+    PricingEngine& pricing;
+    CheckoutPipeline& checkout;
+
+    string email;
+    bool hasCart;
+    deque<PendingCommand*> pending;
+    chrono::steady_clock::time_point commandStart;
+    vector<double> latencies[BATCH_COMMAND_COUNT];
+    int lineNumber;
+    int failures;
+
+    void fail(const char* reason) {
+        cout << "line " << lineNumber << ": " << reason << '\n';
+        failures++;
+    }
+
+    bool needsArguments(CommandTokenizer& tokens, int arguments) {
+        if (tokens.size() == arguments + 1) return true;
+        fail("wrong number of arguments");
+        return false;
+    }
+
+    bool needsCart() {
+        if (hasCart) return true;
+        fail("not logged in");
+        return false;
+    }
+
+    // Queues work for the current user's session worker. The cart's messages and
+    // any journal failure are kept with the command until it is reported.
+    void post(BatchCommand command, function<void(Cart&, PendingCommand&)> work) {
+        PendingCommand* entry = new PendingCommand();
+        entry->lineNumber = lineNumber;
+        entry->command = command;
+        entry->email = email;
+        entry->startedAt = commandStart;
+        entry->failure = NULL;
+        entry->done = entry->posted.get_future();
+        pending.push_back(entry);
+
+        sessions.post(email, [this, entry, work](Session& session) {
+            session.cart.setOutput(entry->output);
+            session.cart.setLineListener([this, entry, &session](ProductHandle product, int quantity) {
+                if (!journal.logCartLine(session.email, product, quantity)) entry->failure = "journal write failed";
+            });
+            work(session.cart, *entry);
+            session.cart.setLineListener(nullptr);
+            session.cart.setOutput(cout);
+            entry->finishedAt = chrono::steady_clock::now();
+            entry->posted.set_value();
+        });
+    }
+
+    bool isFinished(size_t index) {
+        if (pending[index]->done.wait_for(chrono::seconds(0)) != future_status::ready) return false;
+        return pending[index]->command != BATCH_CHECKOUT
+            || pending[index]->result.wait_for(chrono::seconds(0)) == future_status::ready;
+    }
+
+    // Reports finished commands in submission order, first waiting for every
+    // checkout of waitFor (or for everything when waitAll is set).
+    void collect(string_view waitFor, bool waitAll) {
+        size_t mustFinish = waitAll ? pending.size() : 0;
+        for (size_t i = 0; i < pending.size() && !waitFor.empty(); i++) {
+            if (pending[i]->command == BATCH_CHECKOUT && pending[i]->email == waitFor) mustFinish = i + 1;
+        }
+        for (size_t done = 0; !pending.empty(); done++) {
+            if (done >= mustFinish && !isFinished(0)) return;
+            PendingCommand* next = pending.front();
+            next->done.get();
+            double latency = (double)chrono::duration_cast<chrono::nanoseconds>(next->finishedAt - next->startedAt).count();
+            cout << next->output.str();
+            if (next->failure != NULL) {
+                cout << "line " << next->lineNumber << ": " << next->failure << '\n';
+                failures++;
+            }
+            if (next->command == BATCH_CHECKOUT) {
+                CheckoutResult result = next->result.get();
+                latency += result.latencyNanoseconds;
+                if (result.status == CHECKOUT_PLACED) {
+                    sessions.open(next->email).cart.clear();
+                } else {
+                    cout << "line " << next->lineNumber << ": ";
+                    failures++;
+                }
+                printCheckoutResult(result, pricing.hasRules());
+            }
+            latencies[next->command].push_back(latency);
+            pending.pop_front();
+            delete next;
+        }
+    }
+
+    ProductHandle productArgument(string_view text) {
+        int productId;
+        if (!parseInt(text, productId)) return ProductHandle();
+        return catalog.find(productId);
+    }
+
+    // Returns true if the command was handed to a session worker; collect()
+    // records its latency once it completes.
+    bool run(BatchCommand command, CommandTokenizer& tokens) {
+        if (hasCart && command >= BATCH_ADD && command <= BATCH_CHECKOUT) collect(email, false);
+        switch (command) {
+            case BATCH_REGISTER:
+                if (!needsArguments(tokens, 3)) return false;
+                if (users.registerUser(tokens[1], tokens[2], tokens[3]) == NULL) fail("email already registered");
+                return false;
+
+            case BATCH_LOGIN: {
+                if (!needsArguments(tokens, 2)) return false;
+                User* user = users.login(tokens[1], tokens[2]);
+                if (user == NULL) {
+                    fail("login failed");
+                    return false;
+                }
+                email = user->getEmail();
+                hasCart = email != "admin";
+                return false;
+            }
+
+            case BATCH_LOGOUT:
+                email.clear();
+                hasCart = false;
+                return false;
+
+            case BATCH_ADD:
+            case BATCH_REMOVE: {
+                if (!needsArguments(tokens, 2) || !needsCart()) return false;
+                ProductHandle product = productArgument(tokens[1]);
+                int quantity;
+                if (product.get() == NULL) {
+                    fail("product not found");
+                } else if (!parseInt(tokens[2], quantity) || quantity <= 0) {
+                    fail("bad quantity");
+                } else {
+                    post(command, [command, product, quantity](Cart& cart, PendingCommand&) {
+                        if (command == BATCH_ADD) cart.addToCart(product, quantity);
+                        else cart.removeFromCart(product, quantity);
+                    });
+                    return true;
+                }
+                return false;
+            }
+
+            case BATCH_UNDO:
+            case BATCH_REDO:
+                if (!needsArguments(tokens, 0) || !needsCart()) return false;
+                post(command, [command](Cart& cart, PendingCommand&) {
+                    if (command == BATCH_UNDO) cart.undoLastAction();
+                    else cart.redoLastAction();
+                });
+                return true;
+
+            case BATCH_BEGIN:
+            case BATCH_COMMIT:
+                if (!needsArguments(tokens, 0) || !needsCart()) return false;
+                post(command, [command](Cart& cart, PendingCommand&) {
+                    if (command == BATCH_BEGIN) cart.beginTransaction();
+                    else cart.endTransaction();
+                });
+                return true;
+
+            case BATCH_CHECKOUT:
+                if (!needsArguments(tokens, 0) || !needsCart()) return false;
+                post(command, [this](Cart& cart, PendingCommand& entry) {
+                    entry.result = checkout.submit(cart.getItems(), entry.email);
+                });
+                return true;
+
+            case BATCH_UPDATE_STOCK: {
+                if (!needsArguments(tokens, 2)) return false;
+                if (email != "admin") {
+                    fail("update-stock needs the admin login");
+                    return false;
+                }
+                Product* product = productArgument(tokens[1]).get();
+                int stock;
+                if (product == NULL) fail("product not found");
+                else if (!parseInt(tokens[2], stock) || stock < 0) fail("bad stock");
+                else {
+                    // A checkout still in flight would reserve against the old stock and
+                    // its journal record could land after this STOCK_SET.
+                    collect(string_view(), true);
+                    checkout.waitIdle();
+                    product->setStock(stock);
+                    if (!journal.logStockSet(product->getId(), stock)) fail("journal write failed");
+                }
+                return false;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+public:
+    BatchRunner(Catalog& storeCatalog, SessionManager& storeSessions, MyQueue<Order>& storeOrders,
+                int& storeOrderCounter, StoreJournal& storeJournal, UserDirectory& storeUsers, PricingEngine& storePricing,
+                CheckoutPipeline& storeCheckout)
+        : catalog(storeCatalog), sessions(storeSessions), orders(storeOrders),
+          orderCounter(storeOrderCounter), journal(storeJournal), users(storeUsers), pricing(storePricing),
+          checkout(storeCheckout) {
+        hasCart = false;
+        lineNumber = 0;
+        failures = 0;
+    }
+
+    BatchRunner(const BatchRunner&) = delete;
+    BatchRunner& operator=(const BatchRunner&) = delete;
+
+    // Returns the number of commands that failed.
+    int execute(istream& in) {
+        string line;
+        CommandTokenizer tokens;
+        while (getline(in, line)) {
+            lineNumber++;
+            if (!tokens.tokenize(line)) {
+                fail("too many arguments");
+                continue;
+            }
+            if (tokens.size() == 0) continue;
+
+            int command = 0;
+            while (command < BATCH_COMMAND_COUNT && tokens[0] != BATCH_COMMAND_NAMES[command]) command++;
+            if (command == BATCH_COMMAND_COUNT) {
+                fail("unknown command");
+                continue;
+            }
+
+            commandStart = chrono::steady_clock::now();
+            if (!run((BatchCommand)command, tokens)) {
+                chrono::steady_clock::time_point end = chrono::steady_clock::now();
+                latencies[command].push_back((double)chrono::duration_cast<chrono::nanoseconds>(end - commandStart).count());
+            }
+            collect(string_view(), false);
+
+            if (journal.snapshotDue()) {
+                collect(string_view(), true);
+                checkout.waitIdle();
+                if (!journal.snapshot(catalog, sessions, orders, orderCounter)) cout << "Could not save store snapshot.\n";
+            }
+        }
+        collect(string_view(), true);
+        checkout.waitIdle();
+        return failures;
+    }
+
+    // Latency runs from reading the command to its completion, so for checkouts
+    // it covers the pipeline; ops/s is the count over the summed latency.
+    void report(ostream& out) {
+        OutputBuffer buffer(out);
+        buffer.put("command        count     total ms      ops/s     p50 ms     p99 ms\n");
+        for (int i = 0; i < BATCH_COMMAND_COUNT; i++) {
+            vector<double>& measured = latencies[i];
+            if (measured.empty()) continue;
+            double total = 0;
+            for (size_t k = 0; k < measured.size(); k++) total += measured[k];
+            sort(measured.begin(), measured.end());
+            size_t count = measured.size();
+            char row[128];
+            snprintf(row, sizeof(row), "%-12s %7zu %12.3f %10.0f %10.3f %10.3f\n", BATCH_COMMAND_NAMES[i], count,
+                     total / 1e6, total > 0 ? count * 1e9 / total : 0, measured[count / 2] / 1e6,
+                     measured[min(count - 1, count * 99 / 100)] / 1e6);
+            buffer.put(row);
+        }
+        buffer.put("failed: ").put(failures).put('\n');
+    }
+};
+
+// --------------------- Pricing Rules File ---------------------
+// pricing.rules, one rule per line (percentages may have two decimals):
+//   bundle <productId> <buy> <pay>        e.g. "bundle 103 3 2" = 3 for the price of 2
+//   percent <category> <percent>          percent off every product in the category
+//   tier <minimum total> <percent>        off the whole cart once it reaches the total
+//   tax <category> <percent>
+const char* PRICING_RULES_PATH = "pricing.rules";
+
+// Returns 0 when the file is missing or fully read, otherwise the first bad line
+// number (the rules are then left empty).
+int loadPricingRules(const string& path, Catalog& catalog, PricingRules& rules) {
+    ifstream in(path);
+    if (!in) return 0;
+
+    PricingRules loaded;
+    CommandTokenizer tokens;
+    string line;
+    int lineNumber = 0;
+    while (getline(in, line)) {
+        lineNumber++;
+        if (!tokens.tokenize(line)) return lineNumber;
+        if (tokens.size() == 0) continue;
+
+        string_view kind = tokens[0];
+        long long percent, minimum;
+        int productId, buy, pay;
+        if (kind == "bundle" && tokens.size() == 4 && parseInt(tokens[1], productId) && parseInt(tokens[2], buy)
+            && parseInt(tokens[3], pay) && buy > 0 && pay >= 0 && pay <= buy) {
+            loaded.bundles.insert(productId, BundleDeal{buy, pay});
+        } else if ((kind == "percent" || kind == "tax") && tokens.size() == 3 && parseCents(tokens[2], percent)
+                   && percent >= 0 && percent <= (kind == "percent" ? 10000 : 1000000)) {
+            int code = catalog.getCategories().intern(tokens[1]);
+            loaded.setCategoryRate(kind == "percent" ? loaded.percentOffByCategory : loaded.taxByCategory, code, (int)percent);
+        } else if (kind == "tier" && tokens.size() == 3 && parseCents(tokens[1], minimum) && parseCents(tokens[2], percent)
+                   && percent >= 0 && percent <= 10000) {
+            loaded.addTier(minimum, (int)percent);
+        } else {
+            return lineNumber;
+        }
+    }
+    rules = loaded;
+    return 0;
+}
+
+// --------------------- Benchmarks ---------------------
+// Heap allocations made by each thread, counted by the replaced global operator
+// new so benchmarks can report allocations per operation. Only the benchmark
+// build (-DSHOP_BENCH) replaces the allocator; elsewhere allocations per
+// operation are reported as -1.
+#ifdef SHOP_BENCH
+thread_local long long threadAllocations = 0;
+thread_local long long threadAllocatedBytes = 0;
+
+// GCC flags free() on memory from operator new even when new is malloc-backed.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    threadAllocations++;
+    threadAllocatedBytes += (long long)size;
+    void* memory = malloc(size == 0 ? 1 : size);
+    if (memory == NULL) throw bad_alloc();
+    return memory;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete[](void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t) noexcept { free(memory); }
+
+// Over-aligned types (e.g. the catalog's alignas(64) slots) come through here.
+void* operator new(size_t size, align_val_t alignment) {
+    threadAllocations++;
+    threadAllocatedBytes += (long long)size;
+    size_t align = max((size_t)alignment, sizeof(void*));
+#ifdef _WIN32
+    void* memory = _aligned_malloc(size == 0 ? 1 : size, align);
+#else
+    void* memory = NULL;
+    if (posix_memalign(&memory, align, size == 0 ? 1 : size) != 0) memory = NULL;
+#endif
+    if (memory == NULL) throw bad_alloc();
+    return memory;
+}
+
+#ifdef _WIN32
+void alignedFree(void* memory) { _aligned_free(memory); }
+#else
+void alignedFree(void* memory) { free(memory); }
+#endif
+
+void* operator new[](size_t size, align_val_t alignment) { return operator new(size, alignment); }
+void operator delete(void* memory, align_val_t) noexcept { alignedFree(memory); }
+void operator delete[](void* memory, align_val_t) noexcept { alignedFree(memory); }
+void operator delete(void* memory, size_t, align_val_t) noexcept { alignedFree(memory); }
+void operator delete[](void* memory, size_t, align_val_t) noexcept { alignedFree(memory); }
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+// Draws ranks 0..n-1 with P(k) proportional to 1 / (k + 1)^exponent; exponent 0
+// is uniform. Sampling is a binary search over the precomputed CDF.
+class ZipfGenerator {
+private:
+    vector<double> cumulative;
+    uniform_real_distribution<double> unit;
+
+public:
+    ZipfGenerator(int n, double exponent) : unit(0.0, 1.0) {
+        cumulative.resize(max(n, 1));
+        double sum = 0;
+        for (int k = 0; k < (int)cumulative.size(); k++) {
+            sum += 1.0 / pow(k + 1.0, exponent);
+            cumulative[k] = sum;
+        }
+        for (size_t k = 0; k < cumulative.size(); k++) cumulative[k] /= sum;
+    }
+
+    int next(mt19937_64& rng) {
+        double u = unit(rng);
+        int rank = (int)(lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin());
+        return min(rank, (int)cumulative.size() - 1);
+    }
+};
+
+enum CartSizeDistribution {
+    CART_SIZE_FIXED,
+    CART_SIZE_UNIFORM,
+    CART_SIZE_GEOMETRIC
+};
+
+struct BenchConfig {
+    uint64_t seed;
+    int products;
+    int users;
+    double zipfExponent;
+    int cartSize;
+    CartSizeDistribution cartSizes;
+    double minSeconds;
+    RenderFormat format;
+    string filter;
+
+    // Cases with large fixed sizes (marked large) only run when --filter names them.
+    bool selects(const string& name, bool large = false) {
+        if (filter.empty()) return !large;
+        return name.find(filter) != string::npos;
+    }
+
+    BenchConfig() {
+        seed = 42;
+        products = 100000;
+        users = 1000;
+        zipfExponent = 1.0;
+        cartSize = 5;
+        cartSizes = CART_SIZE_GEOMETRIC;
+        minSeconds = 0.2;
+        format = RENDER_JSON;
+    }
+
+    // Cart sizes have mean cartSize: exactly that, uniform on 1..2*cartSize-1, or
+    // geometric starting at 1.
+    int drawCartSize(mt19937_64& rng) {
+        if (cartSizes == CART_SIZE_FIXED || cartSize <= 1) return max(cartSize, 1);
+        if (cartSizes == CART_SIZE_UNIFORM) return 1 + (int)(rng() % (uint64_t)(2 * cartSize - 1));
+        geometric_distribution<int> extra(1.0 / cartSize);
+        return 1 + extra(rng);
+    }
+};
+
+struct BenchResult {
+    string name;
+    long long operations;
+    double nanosecondsPerOp;
+    double allocationsPerOp;
+    double bytesPerOp;
+    double p50Nanoseconds; // per-operation latency, -1 when not measured
+    double p99Nanoseconds;
+};
+
+// A seeded synthetic store: catalog, popularity ranks, users and carts. The same
+// config always builds the same store and the same operation streams.
+class BenchWorkload {
+public:
+    BenchConfig config;
+    Catalog catalog;
+    UserDirectory users;
+    vector<string> emails;
+    ZipfGenerator popularity;
+    mt19937_64 rng;
+
+    BenchWorkload(const BenchConfig& benchConfig)
+        : config(benchConfig), popularity(benchConfig.products, benchConfig.zipfExponent), rng(benchConfig.seed) {
+        catalog.reserve(config.products);
+        for (int i = 0; i < config.products; i++) {
+            string name = "Product " + to_string(i) + " model " + to_string(rng() % 1000);
+            string category = "Category " + to_string(i % 50);
+            catalog.add(Product(i, name, category, 100 + (long long)(rng() % 100000), 1 << 30));
+        }
+        for (int i = 0; i < config.users; i++) {
+            emails.push_back("user" + to_string(i) + "@example.com");
+            users.registerUser("User " + to_string(i), emails.back(), "password" + to_string(i));
+        }
+    }
+
+    ProductHandle popularProduct() { return catalog.find(popularity.next(rng)); }
+
+    // A promotion set touching most carts: bundles on the 100 most popular
+    // products, percent off on a fifth of the categories, three cart tiers and
+    // tax everywhere.
+    void buildPricingRules(PricingRules& rules) {
+        CategoryDictionary& categories = catalog.getCategories();
+        for (int i = 0; i < min(100, config.products); i++) rules.bundles.insert(i, BundleDeal{3, 2});
+        for (int i = 0; i < categories.size(); i++) {
+            if (i % 5 == 0) rules.setCategoryRate(rules.percentOffByCategory, i, 1000 + i * 10);
+            rules.setCategoryRate(rules.taxByCategory, i, 500 + i * 25);
+        }
+        rules.addTier(10000, 200);
+        rules.addTier(50000, 500);
+        rules.addTier(200000, 1000);
+    }
+
+    // Generates cartCount carts of priced lines back to back, as the pipeline's
+    // batch entry point takes them.
+    void fillPricedCarts(int cartCount, vector<PricedLine>& lines, vector<int>& cartStarts) {
+        MyLinkedList items;
+        lines.clear();
+        cartStarts.assign(1, 0);
+        for (int c = 0; c < cartCount; c++) {
+            items.clear();
+            fillCart(items);
+            gatherPricedLines(items, catalog.getCategories(), lines);
+            cartStarts.push_back((int)lines.size());
+        }
+    }
+
+    void fillCart(MyLinkedList& items) {
+        int size = config.drawCartSize(rng);
+        for (int i = 0; i < size; i++) items.add(popularProduct(), 1 + (int)(rng() % 3));
+    }
+};
+
+// Runs body(n) with growing n until at least minSeconds have been spent, then
+// reports time and allocations per operation over all runs.
+BenchResult runBenchmark(const string& name, double minSeconds, function<void(long long)> body) {
+    BenchResult result;
+    result.name = name;
+    result.operations = 0;
+#ifdef SHOP_BENCH
+    long long allocationsBefore = threadAllocations;
+    long long bytesBefore = threadAllocatedBytes;
+#endif
+    double elapsed = 0;
+    long long batch = 16;
+    while (elapsed < minSeconds) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        body(batch);
+        elapsed += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        result.operations += batch;
+        if (batch < (1LL << 24)) batch *= 2;
+    }
+    result.nanosecondsPerOp = elapsed * 1e9 / result.operations;
+    result.allocationsPerOp = -1;
+    result.bytesPerOp = -1;
+    result.p50Nanoseconds = -1;
+    result.p99Nanoseconds = -1;
+#ifdef SHOP_BENCH
+    result.allocationsPerOp = (threadAllocations - allocationsBefore) / (double)result.operations;
+    result.bytesPerOp = (threadAllocatedBytes - bytesBefore) / (double)result.operations;
+#endif
+    return result;
+}
+
+// Like runBenchmark, but times every call of op on its own so the result has
+// p50/p99 latencies.
+BenchResult runLatencyBenchmark(const string& name, double minSeconds, function<void()> op) {
+    BenchResult result;
+    result.name = name;
+#ifdef SHOP_BENCH
+    long long allocationsBefore = threadAllocations;
+    long long bytesBefore = threadAllocatedBytes;
+#endif
+    vector<double> latencies;
+    double elapsed = 0;
+    while (elapsed < minSeconds) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        op();
+        double nanoseconds = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        latencies.push_back(nanoseconds);
+        elapsed += nanoseconds / 1e9;
+    }
+    result.operations = (long long)latencies.size();
+    result.nanosecondsPerOp = elapsed * 1e9 / result.operations;
+    result.allocationsPerOp = -1;
+    result.bytesPerOp = -1;
+#ifdef SHOP_BENCH
+    // The latency vector's own growth is included; it is a fraction of an allocation per op.
+    result.allocationsPerOp = (threadAllocations - allocationsBefore) / (double)result.operations;
+    result.bytesPerOp = (threadAllocatedBytes - bytesBefore) / (double)result.operations;
+#endif
+    sort(latencies.begin(), latencies.end());
+    result.p50Nanoseconds = latencies[latencies.size() / 2];
+    result.p99Nanoseconds = latencies[min(latencies.size() - 1, latencies.size() * 99 / 100)];
+    return result;
+}
+
+// Results that would otherwise be unused are stored here so the compiler can't
+// drop the work that produced them.
+volatile long long benchSink = 0;
+
+// Swallows everything written to it; the cart prints a line per operation.
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize count) override { return count; }
+};
+
+const char* BENCH_JOURNAL_PATH = "bench.wal";
+const char* BENCH_CATALOG_PATH = "bench.cat";
+const char* BENCH_CSV_PATH = "bench.csv";
+
+// Asks the OS to drop a file's cached pages so the next read comes from disk.
+// Best effort: a no-op where posix_fadvise is missing.
+void evictFileCache(const char* path) {
+#ifndef _WIN32
+    int fd = ::open(path, O_RDONLY);
+    if (fd == -1) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+#else
+    (void)path;
+#endif
+}
+
+// End-to-end checkout against a fresh journal, in rounds of CHECKOUT_ROUND carts
+// generated untimed. checkout_sync calls placeOrder for one cart after another;
+// checkout_pipeline submits the whole round and then waits for every future, so
+// its latency includes queueing behind the rest of the round. nsPerOp is the
+// inverse of throughput.
+BenchResult runCheckoutBenchmark(const string& name, BenchWorkload& workload, bool pipelined) {
+    const int CHECKOUT_ROUND = 256;
+    MyQueue<Order> orders;
+    int orderCounter = 1;
+    StoreJournal journal;
+    journal.openEmpty(BENCH_JOURNAL_PATH);
+    SalesRollup rollup(workload.catalog);
+    PricingEngine pricing(workload.catalog);
+    workload.buildPricingRules(pricing.getRules());
+    CheckoutPipeline pipeline(workload.catalog, orders, orderCounter, journal, rollup, pricing);
+
+    vector<Cart> carts(CHECKOUT_ROUND);
+    vector<future<CheckoutResult>> completions(CHECKOUT_ROUND);
+    vector<double> latencies;
+    double elapsed = 0;
+    while (elapsed < workload.config.minSeconds) {
+        for (int c = 0; c < CHECKOUT_ROUND; c++) {
+            carts[c].clear();
+            int size = workload.config.drawCartSize(workload.rng);
+            for (int i = 0; i < size; i++) carts[c].addToCart(workload.popularProduct(), 1 + (int)(workload.rng() % 3));
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int c = 0; c < CHECKOUT_ROUND; c++) {
+            const string& email = workload.emails[c % workload.emails.size()];
+            if (pipelined) {
+                completions[c] = pipeline.submit(carts[c].getItems(), email);
+                continue;
+            }
+            chrono::steady_clock::time_point placed = chrono::steady_clock::now();
+            placeOrder(carts[c], email, orders, orderCounter, journal, rollup, pricing);
+            latencies.push_back((double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - placed).count());
+        }
+        for (int c = 0; c < CHECKOUT_ROUND && pipelined; c++) latencies.push_back(completions[c].get().latencyNanoseconds);
+        elapsed += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    pipeline.waitIdle();
+    journal.syncLog();
+    ::remove(BENCH_JOURNAL_PATH);
+
+    BenchResult result;
+    result.name = name;
+    result.operations = (long long)latencies.size();
+    result.nanosecondsPerOp = elapsed * 1e9 / result.operations;
+    // The pipeline allocates on its own threads, which the per-thread counters miss.
+    result.allocationsPerOp = -1;
+    result.bytesPerOp = -1;
+    sort(latencies.begin(), latencies.end());
+    result.p50Nanoseconds = latencies[latencies.size() / 2];
+    result.p99Nanoseconds = latencies[min(latencies.size() - 1, latencies.size() * 99 / 100)];
+    return result;
+}
+
+// MyQueue behind a single mutex, bounded like the ring, as the baseline for
+// MyConcurrentQueue.
+class LockedQueue {
+private:
+    MyQueue<long long> queue;
+    mutex lock;
+    int capacity;
+
+public:
+    LockedQueue(int cap) : queue(cap), capacity(cap) {}
+
+    bool tryPush(long long value) {
+        lock_guard<mutex> guard(lock);
+        if (queue.size() >= capacity) return false;
+        queue.push(value);
+        return true;
+    }
+
+    int popBatch(long long* out, int maxItems) {
+        lock_guard<mutex> guard(lock);
+        int count = 0;
+        while (count < maxItems && !queue.isEmpty()) {
+            out[count++] = queue.front();
+            queue.pop();
+        }
+        return count;
+    }
+};
+
+// Moves n items from producers threads to consumers threads, one at a time.
+template <typename Queue>
+void transferThroughQueue(Queue& queue, long long n, int producers, int consumers) {
+    atomic<long long> consumed{0};
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&queue, n, producers, p] {
+            for (long long i = p; i < n; i += producers) {
+                while (!queue.tryPush(i)) this_thread::yield();
+            }
+        });
+    }
+    for (int c = 0; c < consumers; c++) {
+        threads.emplace_back([&queue, &consumed, n] {
+            long long item, sum = 0;
+            while (consumed.load(memory_order_relaxed) < n) {
+                if (queue.popBatch(&item, 1) == 0) {
+                    this_thread::yield();
+                    continue;
+                }
+                sum += item;
+                consumed.fetch_add(1, memory_order_relaxed);
+            }
+            benchSink = sum;
+        });
+    }
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+}
+
+enum SessionOp {
+    SESSION_BROWSE,
+    SESSION_ADD,
+    SESSION_REMOVE,
+    SESSION_UNDO,
+    SESSION_CHECKOUT,
+    SESSION_OP_COUNT
+};
+
+const char* SESSION_OP_NAMES[SESSION_OP_COUNT] = {"browse", "add", "remove", "undo", "checkout"};
+const int SESSION_OP_PERCENT[SESSION_OP_COUNT] = {40, 30, 10, 10, 10};
+
+// Synthetic shoppers: config.users sessions, each op drawn from the mix above
+// for a random user, in rounds of SESSION_ROUND. Browse looks up a Zipf-popular
+// product, add puts one in the cart, remove takes one unit of the cart's first
+// line, undo undoes the last change, and checkout goes through the pipeline
+// (against a fresh journal; stock is effectively unlimited).
+// session_pool posts every op to its session's shard worker and drains once
+// per round; latency runs from post() to the op finishing, so it includes
+// queueing behind the rest of the round. Its checkouts don't hold the worker:
+// the cart is cleared once the lines are submitted and the latency runs to the
+// order's completion. session_inline runs the same stream on the calling
+// thread and waits for each checkout. Results are per op type, e.g. session_pool_checkout,
+// with ns/op the mean latency.
+void runSessionBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    const int SESSION_ROUND = 1024;
+    for (int pooled = 0; pooled < 2; pooled++) {
+        string prefix = pooled ? "session_pool_" : "session_inline_";
+        bool any = false;
+        for (int op = 0; op < SESSION_OP_COUNT; op++) any = any || workload.config.selects(prefix + SESSION_OP_NAMES[op]);
+        if (!any) continue;
+
+        workload.rng.seed(workload.config.seed + pooled);
+        MyQueue<Order> orders;
+        int orderCounter = 1;
+        StoreJournal journal;
+        journal.openEmpty(BENCH_JOURNAL_PATH);
+        SalesRollup rollup(workload.catalog);
+        PricingEngine pricing(workload.catalog);
+        workload.buildPricingRules(pricing.getRules());
+        CheckoutPipeline checkout(workload.catalog, orders, orderCounter, journal, rollup, pricing);
+        SessionManager sessions;
+        vector<Session*> users;
+        for (size_t u = 0; u < workload.emails.size(); u++) users.push_back(&sessions.open(workload.emails[u]));
+
+        Catalog& catalog = workload.catalog;
+        vector<future<CheckoutResult>> roundCheckouts(SESSION_ROUND);
+        auto apply = [&catalog, &checkout](Session& session, SessionOp op, ProductHandle product,
+                                           future<CheckoutResult>* pending) {
+            Cart& cart = session.cart;
+            if (op == SESSION_BROWSE) {
+                Product* found = catalog.find(product.get()->getId()).get();
+                benchSink = found->getPriceCents() + found->getStock() + (long long)found->getName().size();
+            } else if (op == SESSION_ADD) {
+                cart.addToCart(product, 1);
+            } else if (op == SESSION_REMOVE) {
+                CartItem* first = cart.getItems().getHead();
+                if (first != NULL) cart.removeFromCart(first->product, 1);
+            } else if (op == SESSION_UNDO) {
+                cart.undoLastAction();
+            } else if (pending != NULL) {
+                *pending = checkout.submit(cart.getItems(), session.email);
+                cart.clear();
+            } else if (checkout.submit(cart.getItems(), session.email).get().status == CHECKOUT_PLACED) {
+                cart.clear();
+            }
+        };
+
+        vector<chrono::steady_clock::time_point> postedAt(SESSION_ROUND);
+        vector<double> roundLatencies(SESSION_ROUND);
+        vector<SessionOp> roundOps(SESSION_ROUND);
+        vector<double> latencies[SESSION_OP_COUNT];
+        double elapsed = 0;
+        while (elapsed < workload.config.minSeconds) {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for (int i = 0; i < SESSION_ROUND; i++) {
+                Session* user = users[workload.rng() % users.size()];
+                int draw = (int)(workload.rng() % 100);
+                int op = 0;
+                while (draw >= SESSION_OP_PERCENT[op]) draw -= SESSION_OP_PERCENT[op++];
+                roundOps[i] = (SessionOp)op;
+                ProductHandle product = workload.popularProduct();
+                if (!pooled) {
+                    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+                    apply(*user, roundOps[i], product, NULL);
+                    roundLatencies[i] = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count();
+                    continue;
+                }
+                postedAt[i] = chrono::steady_clock::now();
+                sessions.post(user->email, [&, i, product](Session& session) {
+                    static thread_local NullBuffer discard;
+                    static thread_local ostream quiet(&discard);
+                    session.cart.setOutput(quiet);
+                    apply(session, roundOps[i], product, &roundCheckouts[i]);
+                    roundLatencies[i] = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - postedAt[i]).count();
+                });
+            }
+            if (pooled) {
+                sessions.drain();
+                for (int i = 0; i < SESSION_ROUND; i++) {
+                    if (roundOps[i] == SESSION_CHECKOUT) roundLatencies[i] += roundCheckouts[i].get().latencyNanoseconds;
+                }
+            }
+            elapsed += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            for (int i = 0; i < SESSION_ROUND; i++) latencies[roundOps[i]].push_back(roundLatencies[i]);
+        }
+        checkout.waitIdle();
+
+        for (int op = 0; op < SESSION_OP_COUNT; op++) {
+            vector<double>& measured = latencies[op];
+            if (!workload.config.selects(prefix + SESSION_OP_NAMES[op]) || measured.empty()) continue;
+            BenchResult result;
+            result.name = prefix + SESSION_OP_NAMES[op];
+            result.operations = (long long)measured.size();
+            double total = 0;
+            for (size_t k = 0; k < measured.size(); k++) total += measured[k];
+            result.nanosecondsPerOp = total / measured.size();
+            // Pooled ops allocate on the shard workers, which the per-thread counters miss.
+            result.allocationsPerOp = -1;
+            result.bytesPerOp = -1;
+            sort(measured.begin(), measured.end());
+            result.p50Nanoseconds = measured[measured.size() / 2];
+            result.p99Nanoseconds = measured[min(measured.size() - 1, measured.size() * 99 / 100)];
+            results.push_back(result);
+        }
+    }
+    ::remove(BENCH_JOURNAL_PATH);
+}
+
+// Catalog::find against the linear scan over vector<Product> that main() used
+// before, at 1k, 100k and 1M products; one op is one lookup of a uniformly random
+// id. The 1M pair is large.
+void runCatalogScaleBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    const int SIZES[3] = {1000, 100000, 1000000};
+    const char* LABELS[3] = {"1k", "100k", "1m"};
+    for (int s = 0; s < 3; s++) {
+        string findName = string("catalog_find_") + LABELS[s], scanName = string("catalog_scan_") + LABELS[s];
+        bool large = SIZES[s] > 100000;
+        bool find = workload.config.selects(findName, large), scan = workload.config.selects(scanName, large);
+        if (!find && !scan) continue;
+
+        int size = SIZES[s];
+        Catalog catalog;
+        vector<Product> products;
+        catalog.reserve(size);
+        products.reserve(size);
+        for (int i = 0; i < size; i++) {
+            Product product(i, "Product", "Category", 100, 1);
+            catalog.add(product);
+            products.push_back(product);
+        }
+        mt19937_64& rng = workload.rng;
+        if (find) {
+            rng.seed(workload.config.seed);
+            results.push_back(runBenchmark(findName, workload.config.minSeconds, [&](long long n) {
+                long long found = 0;
+                for (long long i = 0; i < n; i++) found += catalog.find((int)(rng() % size)).get() != NULL;
+                benchSink = found;
+            }));
+        }
+        if (scan) {
+            rng.seed(workload.config.seed);
+            results.push_back(runBenchmark(scanName, workload.config.minSeconds, [&](long long n) {
+                long long found = 0;
+                for (long long i = 0; i < n; i++) {
+                    int id = (int)(rng() % size);
+                    for (size_t k = 0; k < products.size(); k++) {
+                        if (products[k].getId() == id) {
+                            found++;
+                            break;
+                        }
+                    }
+                }
+                benchSink = found;
+            }));
+        }
+    }
+}
+
+// Stock reservation under contention: T threads each reserve and release one
+// unit at a time, either all on the single most popular product (a flash sale)
+// or on products drawn uniformly from the catalog. One op is one reserve+release.
+void runStockContentionBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    const int THREADS[3] = {1, 4, 16};
+    Catalog& catalog = workload.catalog;
+    int products = workload.config.products;
+    for (int t = 0; t < 3; t++) {
+        for (int hot = 1; hot >= 0; hot--) {
+            int threads = THREADS[t];
+            string name = string(hot ? "reserve_hot_" : "reserve_uniform_") + to_string(threads) + "t";
+            if (!workload.config.selects(name)) continue;
+            uint64_t seed = workload.config.seed;
+            results.push_back(runBenchmark(name, workload.config.minSeconds, [&, threads, hot, seed](long long n) {
+                atomic<long long> reserved{0};
+                vector<thread> workers;
+                for (int w = 0; w < threads; w++) {
+                    workers.emplace_back([&, w] {
+                        mt19937_64 rng(seed + w);
+                        long long done = 0;
+                        for (long long i = w; i < n; i += threads) {
+                            Product* product = catalog.find(hot ? 0 : (int)(rng() % products)).get();
+                            if (!product->reserveStock(1)) continue;
+                            product->releaseStock(1);
+                            done++;
+                        }
+                        reserved += done;
+                    });
+                }
+                for (size_t w = 0; w < workers.size(); w++) workers[w].join();
+                benchSink = reserved;
+            }));
+        }
+    }
+}
+
+// Registration and login against a directory already holding 10k, 1M or 10M
+// users; one op is one register of a new email or one login of a random existing
+// user. Emails are formatted into a stack buffer, so the timed loop only allocates
+// inside the directory. The 1M and 10M sizes are large.
+void runUserScaleBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    const int SIZES[3] = {10000, 1000000, 10000000};
+    const char* LABELS[3] = {"10k", "1m", "10m"};
+    for (int s = 0; s < 3; s++) {
+        string registerName = string("user_register_") + LABELS[s], loginName = string("user_login_") + LABELS[s];
+        bool large = SIZES[s] > 10000;
+        bool registers = workload.config.selects(registerName, large), logins = workload.config.selects(loginName, large);
+        if (!registers && !logins) continue;
+
+        int size = SIZES[s];
+        char email[32];
+        auto emailFor = [&email](const char* prefix, long long id) {
+            return string_view(email, (size_t)snprintf(email, sizeof(email), "%s%lld@x.io", prefix, id));
+        };
+        UserDirectory users;
+        for (int i = 0; i < size; i++) users.registerUser("U", emailFor("u", i), "password");
+        mt19937_64& rng = workload.rng;
+        if (registers) {
+            long long next = 0;
+            results.push_back(runBenchmark(registerName, workload.config.minSeconds, [&](long long n) {
+                for (long long i = 0; i < n; i++) benchSink = users.registerUser("N", emailFor("n", next++), "password") != NULL;
+            }));
+        }
+        if (logins) {
+            rng.seed(workload.config.seed);
+            results.push_back(runBenchmark(loginName, workload.config.minSeconds, [&](long long n) {
+                long long ok = 0;
+                for (long long i = 0; i < n; i++) ok += users.login(emailFor("u", (long long)(rng() % size)), "password") != NULL;
+                benchSink = ok;
+            }));
+        }
+    }
+}
+
+// The array-of-structs scan queryProducts replaces: every product record is
+// visited and its category string compared. Same results as queryProducts.
+vector<Product*> queryProductsScalar(Catalog& catalog, const ProductQuery& query) {
+    vector<pair<long long, int>> candidates;
+    for (int i = 0; i < catalog.slotLimit(); i++) {
+        Product* product = catalog.productAt(i);
+        if (product == NULL) continue;
+        if (!query.category.empty() && product->getCategory() != query.category) continue;
+        long long price = product->getPriceCents();
+        if (price < query.minPriceCents || price > query.maxPriceCents) continue;
+        if (query.inStockOnly && product->getStock() <= 0) continue;
+        candidates.push_back(make_pair(price, i));
+    }
+    size_t keep = candidates.size();
+    if (query.limit > 0 && (size_t)query.limit < keep) keep = query.limit;
+    partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end());
+
+    vector<Product*> results;
+    for (size_t i = 0; i < keep; i++) results.push_back(catalog.productAt(candidates[i].second));
+    return results;
+}
+
+// Building a 1M-product catalog through Catalog::add (names copied into the
+// arena, categories interned) against the vector of std::string product records
+// it replaced. Names are generated beforehand; results are per product, so
+// allocs/op and bytes/op are allocations and bytes per product. Large.
+void runCatalogBuildBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    struct StringProduct {
+        int id;
+        string name;
+        string category;
+        long long priceCents;
+        int stock;
+    };
+    const int SIZE = 1000000;
+    bool arena = workload.config.selects("catalog_add_1m", true);
+    bool strings = workload.config.selects("catalog_add_strings_1m", true);
+    if (!arena && !strings) return;
+
+    workload.rng.seed(workload.config.seed);
+    vector<string> names(SIZE), categories(50);
+    for (int i = 0; i < SIZE; i++) names[i] = "Product " + to_string(i) + " model " + to_string(workload.rng() % 1000);
+    for (int i = 0; i < 50; i++) categories[i] = "Category " + to_string(i);
+
+    for (int pass = 0; pass < 2; pass++) {
+        bool stringPass = pass == 1;
+        if (!(stringPass ? strings : arena)) continue;
+        BenchResult result = runBenchmark(stringPass ? "catalog_add_strings_1m" : "catalog_add_1m", workload.config.minSeconds,
+                                          [&](long long n) {
+            for (long long r = 0; r < n; r++) {
+                if (stringPass) {
+                    vector<StringProduct> products;
+                    for (int i = 0; i < SIZE; i++) products.push_back(StringProduct{i, names[i], categories[i % 50], 100, 1});
+                    benchSink = (long long)products.size();
+                } else {
+                    Catalog catalog;
+                    for (int i = 0; i < SIZE; i++) catalog.add(Product(i, names[i], categories[i % 50], 100, 1));
+                    benchSink = catalog.size();
+                }
+            }
+        });
+        result.operations *= SIZE;
+        result.nanosecondsPerOp /= SIZE;
+        if (result.allocationsPerOp >= 0) {
+            result.allocationsPerOp /= SIZE;
+            result.bytesPerOp /= SIZE;
+        }
+        results.push_back(result);
+    }
+}
+
+// Top-20 queries (one of 50 categories, a $100 price window) through the
+// column filter and through the scalar scan over the product records. The _10m
+// pair runs on its own 10M-product catalog and is large.
+void runProductQueryBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    for (int large = 0; large < 2; large++) {
+        string suffix = large ? "_10m" : "";
+        string simdName = "product_query_simd" + suffix, scalarName = "product_query_scalar" + suffix;
+        bool simd = workload.config.selects(simdName, large), scalar = workload.config.selects(scalarName, large);
+        if (!simd && !scalar) continue;
+
+        Catalog* own = NULL;
+        if (large) {
+            const int SIZE = 10000000;
+            own = new Catalog();
+            own->reserve(SIZE);
+            for (int i = 0; i < SIZE; i++) {
+                string category = "Category " + to_string(i % 50);
+                own->add(Product(i, "Product", category, 100 + (long long)(workload.rng() % 100000), 1));
+            }
+        }
+        Catalog& catalog = large ? *own : workload.catalog;
+        for (int pass = 0; pass < 2; pass++) {
+            bool scalarPass = pass == 1;
+            if (!(scalarPass ? scalar : simd)) continue;
+            workload.rng.seed(workload.config.seed);
+            results.push_back(runBenchmark(scalarPass ? scalarName : simdName, workload.config.minSeconds, [&](long long n) {
+                ProductQuery query;
+                query.limit = 20;
+                for (long long i = 0; i < n; i++) {
+                    query.category = "Category " + to_string(workload.rng() % 50);
+                    query.minPriceCents = (long long)(workload.rng() % 50000);
+                    query.maxPriceCents = query.minPriceCents + 10000;
+                    benchSink = (long long)(scalarPass ? queryProductsScalar(catalog, query) : queryProducts(catalog, query)).size();
+                }
+            }));
+        }
+        delete own;
+    }
+}
 
-public:
-    MyLinkedList() { head = NULL; }
+// The search menu's two lookups: suggest(prefix, 5) for a 1-4 letter prefix of a
+// word from a random product's name, and search(query, 20) for two words of one
+// product's name. Both run on the workload catalog and on a 5M-product catalog
+// (large) whose names combine a thousand made-up words and a model number.
+void runSearchBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    for (int large = 0; large < 2; large++) {
+        string suffix = large ? "_5m" : "";
+        string suggestName = "search_suggest" + suffix, queryName = "search_query" + suffix;
+        bool suggest = workload.config.selects(suggestName, large), query = workload.config.selects(queryName, large);
+        if (!suggest && !query) continue;
 
-    void add(CartItem* newItem) {
-        CartItem* temp = head;
-        while (temp != NULL) {
-            if (temp->product->getId() == newItem->product->getId()) {
-                temp->quantity += newItem->quantity;
-                return;
+        mt19937_64& rng = workload.rng;
+        rng.seed(workload.config.seed);
+        Catalog* own = NULL;
+        if (large) {
+            const int SIZE = 5000000;
+            const char* SYLLABLES[10] = {"ka", "lo", "mi", "ne", "ra", "su", "ti", "vo", "ze", "pa"};
+            own = new Catalog();
+            own->reserve(SIZE);
+            string name;
+            for (int i = 0; i < SIZE; i++) {
+                name.clear();
+                for (int word = 0; word < 3; word++) {
+                    int pick = (int)(rng() % 1000);
+                    name += SYLLABLES[pick / 100];
+                    name += SYLLABLES[pick / 10 % 10];
+                    name += SYLLABLES[pick % 10];
+                    name += ' ';
+                }
+                name += to_string(rng() % 1000);
+                own->add(Product(i, name, "Category " + to_string(i % 50), 100, 1));
             }
-            temp = temp->next;
         }
+        Catalog& catalog = large ? *own : workload.catalog;
+        ProductSearchIndex& index = catalog.getSearchIndex();
+        int slots = catalog.slotLimit();
+        auto randomWords = [&catalog, &rng, slots](vector<string_view>& words) {
+            words.clear();
+            Product* product = NULL;
+            while (product == NULL) product = catalog.productAt((int)(rng() % slots));
+            string_view name = product->getName();
+            for (size_t start = 0; start < name.size();) {
+                size_t end = name.find(' ', start);
+                if (end == string_view::npos) end = name.size();
+                if (end > start) words.push_back(name.substr(start, end - start));
+                start = end + 1;
+            }
+        };
 
-        if (head == NULL) {
-            head = newItem;
-        } else {
-            temp = head;
-            while (temp->next != NULL) temp = temp->next;
-            temp->next = newItem;
+        vector<string_view> words;
+        if (suggest) {
+            results.push_back(runLatencyBenchmark(suggestName, workload.config.minSeconds, [&] {
+                randomWords(words);
+                string_view word = words[rng() % words.size()];
+                benchSink = (long long)index.suggest(word.substr(0, 1 + rng() % 4), 5).size();
+            }));
         }
+        if (query) {
+            string text;
+            results.push_back(runLatencyBenchmark(queryName, workload.config.minSeconds, [&] {
+                randomWords(words);
+                text = string(words[rng() % words.size()]) + " " + string(words[rng() % words.size()]);
+                benchSink = (long long)index.search(text, 20).size();
+            }));
+        }
+        delete own;
     }
+}
 
-    void remove(int productId, int quantityToRemove) {
-        CartItem* temp = head;
-        CartItem* previous = NULL;
+// The cart nodes behind one checkout, for a new shopper's cart of 4, 8 (the
+// pool's inline capacity) and 32 lines: fill the cart, build the order, drop
+// both. checkout_alloc_pool uses MyLinkedList and Order; checkout_alloc_heap
+// is the list it replaced, one new CartItem per cart line plus one per order
+// line, freed one by one. Compare allocs/op.
+void runCheckoutAllocationBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    const int SIZES[3] = {4, 8, 32};
+    for (int s = 0; s < 3; s++) {
+        int size = min(SIZES[s], workload.config.products);
+        string poolName = "checkout_alloc_pool_" + to_string(SIZES[s]), heapName = "checkout_alloc_heap_" + to_string(SIZES[s]);
+        bool pool = workload.config.selects(poolName), heap = workload.config.selects(heapName);
+        if (!pool && !heap) continue;
+        vector<ProductHandle> products;
+        for (int i = 0; i < size; i++) products.push_back(workload.catalog.find(i));
 
-        while (temp != NULL) {
-            if (temp->product->getId() == productId) {
-                if (quantityToRemove >= temp->quantity) {
-                    if (previous == NULL) head = temp->next;
-                    else previous->next = temp->next;
-                    delete temp;
-                } else {
-                    temp->quantity -= quantityToRemove;
+        if (pool) {
+            results.push_back(runBenchmark(poolName, workload.config.minSeconds, [&](long long n) {
+                for (long long i = 0; i < n; i++) {
+                    MyLinkedList items;
+                    for (int k = 0; k < size; k++) items.add(products[k], 1);
+                    Order order((int)i, items);
+                    benchSink = order.getTotalCents();
                 }
-                return;
-            }
-            previous = temp;
-            temp = temp->next;
+            }));
+        }
+        if (heap) {
+            auto append = [](CartItem*& head, CartItem* node) {
+                CartItem** link = &head;
+                while (*link != NULL) {
+                    if ((*link)->product == node->product) {
+                        (*link)->quantity += node->quantity;
+                        delete node;
+                        return;
+                    }
+                    link = &(*link)->next;
+                }
+                *link = node;
+            };
+            auto release = [](CartItem* head) {
+                while (head != NULL) {
+                    CartItem* next = head->next;
+                    delete head;
+                    head = next;
+                }
+            };
+            results.push_back(runBenchmark(heapName, workload.config.minSeconds, [&](long long n) {
+                for (long long i = 0; i < n; i++) {
+                    CartItem* cart = NULL;
+                    CartItem* order = NULL;
+                    for (int k = 0; k < size; k++) append(cart, new CartItem(products[k], 1));
+                    long long total = 0;
+                    for (CartItem* temp = cart; temp != NULL; temp = temp->next) {
+                        append(order, new CartItem(temp->product, temp->quantity));
+                        total += temp->product.get()->getPriceCents() * temp->quantity;
+                    }
+                    benchSink = total;
+                    release(cart);
+                    release(order);
+                }
+            }));
         }
     }
+}
 
-    void display() {
-        if (head == NULL) {
-            cout << "Cart is empty." << endl;
-            return;
-        }
+// Checkout's total on carts of 1 to 10k lines: each op changes one line's
+// quantity and prices the cart, through the running subtotal and through a
+// walk over every line as the total was computed before.
+void runCartTotalBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    const int SIZES[4] = {1, 100, 1000, 10000};
+    for (int s = 0; s < 4; s++) {
+        int size = min(SIZES[s], workload.config.products);
+        string runningName = "cart_total_" + to_string(SIZES[s]), walkName = "cart_total_walk_" + to_string(SIZES[s]);
+        bool running = workload.config.selects(runningName), walk = workload.config.selects(walkName);
+        if (!running && !walk) continue;
 
-        CartItem* temp = head;
-        cout << "Current Cart:" << endl;
-        while (temp != NULL) {
-            cout << temp->product->getName() << " x" << temp->quantity
-                 << " - $" << temp->product->getPrice()
-                 << " each, Total: $" << temp->quantity * temp->product->getPrice()
-                 << endl;
-            temp = temp->next;
+        MyLinkedList items;
+        vector<ProductHandle> lines;
+        for (int i = 0; i < size; i++) {
+            lines.push_back(workload.catalog.find(i));
+            items.add(lines.back(), 1 + i % 3);
+        }
+        for (int pass = 0; pass < 2; pass++) {
+            bool walkPass = pass == 1;
+            if (!(walkPass ? walk : running)) continue;
+            workload.rng.seed(workload.config.seed);
+            results.push_back(runBenchmark(walkPass ? walkName : runningName, workload.config.minSeconds, [&](long long n) {
+                long long total = 0;
+                for (long long i = 0; i < n; i++) {
+                    ProductHandle product = lines[workload.rng() % size];
+                    items.add(product, 1);
+                    if (walkPass) {
+                        for (CartItem* temp = items.getHead(); temp != NULL; temp = temp->next) {
+                            Product* current = temp->product.get();
+                            if (current != NULL) total += current->getPriceCents() * temp->quantity;
+                        }
+                    } else {
+                        total += items.getSubtotalCents();
+                    }
+                    items.remove(product, 1);
+                }
+                benchSink = total;
+            }));
         }
     }
+}
 
-    CartItem* getHead() { return head; }
+// analyzeOrders over an order history on 1, 2, 4, ... threads up to one per
+// core, reported per order scanned so the thread counts compare directly. The
+// history is 200k orders spread over 30 days, or 5M for the _5m cases (large).
+void runAnalyticsBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    int cores = max(1, (int)thread::hardware_concurrency());
+    vector<int> threadCounts;
+    for (int t = 1; t < cores; t *= 2) threadCounts.push_back(t);
+    threadCounts.push_back(cores);
 
-    void clear() {
-        CartItem* temp = head;
-        while (temp != NULL) {
-            CartItem* toDelete = temp;
-            temp = temp->next;
-            delete toDelete;
+    for (int large = 0; large < 2; large++) {
+        string prefix = large ? "analytics_scan_5m_" : "analytics_scan_";
+        vector<string> names;
+        bool any = false;
+        for (size_t t = 0; t < threadCounts.size(); t++) {
+            names.push_back(prefix + to_string(threadCounts[t]) + "t");
+            any = any || workload.config.selects(names.back(), large);
+        }
+        if (!any) continue;
+
+        const int ORDER_COUNT = large ? 5000000 : 200000;
+        const long long START = 1700000000LL, SPAN = 30LL * 24 * 3600;
+        workload.rng.seed(workload.config.seed);
+        MyQueue<Order> orders;
+        vector<OrderLine> lines;
+        for (int i = 0; i < ORDER_COUNT; i++) {
+            lines.clear();
+            long long total = 0;
+            int size = workload.config.drawCartSize(workload.rng);
+            for (int l = 0; l < size; l++) {
+                ProductHandle product = workload.popularProduct();
+                Product* current = product.get();
+                int quantity = 1 + (int)(workload.rng() % 3);
+                long long unitCents = current->getPriceCents();
+                lines.push_back(OrderLine{product, quantity, unitCents, unitCents * quantity, current->getName()});
+                total += unitCents * quantity;
+            }
+            orders.push(Order(i + 1, lines, total, START + (long long)(workload.rng() % SPAN)));
+        }
+
+        for (size_t t = 0; t < threadCounts.size(); t++) {
+            if (!workload.config.selects(names[t], large)) continue;
+            int threads = threadCounts[t];
+            BenchResult result = runBenchmark(names[t], workload.config.minSeconds, [&, threads](long long n) {
+                for (long long i = 0; i < n; i++) benchSink = analyzeOrders(orders, workload.catalog, 3600, threads).revenueCents;
+            });
+            result.operations *= ORDER_COUNT;
+            result.nanosecondsPerOp /= ORDER_COUNT;
+            if (result.allocationsPerOp >= 0) {
+                result.allocationsPerOp /= ORDER_COUNT;
+                result.bytesPerOp /= ORDER_COUNT;
+            }
+            results.push_back(result);
         }
-        head = NULL;
     }
-};
+}
 
-// --------------------- User Class ---------------------
-class User {
-private:
-    string name;
-    string email;
-    string password;
+// Listing the catalog to the null device: catalog_render goes through
+// Catalog::render and one OutputBuffer, catalog_render_endl writes each product
+// with cout-style << and endl as Product::display used to. One op is one full
+// listing of the workload catalog, or of a 1M-product catalog for the _1m pair
+// (large).
+void runCatalogRenderBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+#ifdef _WIN32
+    const char* NULL_DEVICE = "NUL";
+#else
+    const char* NULL_DEVICE = "/dev/null";
+#endif
+    for (int large = 0; large < 2; large++) {
+        string suffix = large ? "_1m" : "";
+        string bufferedName = "catalog_render" + suffix, endlName = "catalog_render_endl" + suffix;
+        bool buffered = workload.config.selects(bufferedName, large), endlines = workload.config.selects(endlName, large);
+        if (!buffered && !endlines) continue;
 
-public:
-    User(string userName, string userEmail, string userPassword) {
-        name = userName;
-        email = userEmail;
-        password = userPassword;
+        Catalog* own = NULL;
+        if (large) {
+            const int SIZE = 1000000;
+            own = new Catalog();
+            own->reserve(SIZE);
+            for (int i = 0; i < SIZE; i++) {
+                string name = "Product " + to_string(i) + " model " + to_string(workload.rng() % 1000);
+                own->add(Product(i, name, "Category " + to_string(i % 50), 100 + (long long)(workload.rng() % 100000), 1));
+            }
+        }
+        Catalog& catalog = large ? *own : workload.catalog;
+        ofstream sink(NULL_DEVICE);
+        if (buffered) {
+            results.push_back(runLatencyBenchmark(bufferedName, workload.config.minSeconds, [&] {
+                OutputBuffer out(sink);
+                catalog.render(out, RENDER_TEXT);
+            }));
+        }
+        if (endlines) {
+            results.push_back(runLatencyBenchmark(endlName, workload.config.minSeconds, [&] {
+                for (int i = 0; i < catalog.slotLimit(); i++) {
+                    Product* product = catalog.productAt(i);
+                    if (product == NULL) continue;
+                    sink << "ID: " << product->getId()
+                         << " Name: " << product->getName()
+                         << " Category: " << product->getCategory()
+                         << " Price: $" << formatMoney(product->getPriceCents())
+                         << " Stock: " << product->getStock() << endl;
+                }
+            }));
+        }
+        delete own;
     }
+}
+
+// 10M retained orders of three lines each. orders_retain_10m times placing
+// them into a presized queue, so allocs/op and bytes/op are what one retained
+// order costs (its Order slot plus its line block). orders_view_10m renders
+// the whole history as View Orders does, to a discarding stream; one op is one
+// full view. Both are large.
+void runOrderHistoryBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    const int SIZE = 10000000, LINES = 3;
+    bool retain = workload.config.selects("orders_retain_10m", true);
+    bool view = workload.config.selects("orders_view_10m", true);
+    if (!retain && !view) return;
 
-    string getEmail() { return email; }
-    string getName() { return name; }
+    workload.rng.seed(workload.config.seed);
+    vector<ProductHandle> products(1024);
+    for (size_t i = 0; i < products.size(); i++) products[i] = workload.popularProduct();
+    vector<OrderLine> lines;
+    lines.reserve(LINES);
 
-    bool login(string loginEmail, string loginPassword) {
-        return (email == loginEmail && password == loginPassword);
+    MyQueue<Order> orders(SIZE);
+    BenchResult result;
+    result.name = "orders_retain_10m";
+    result.operations = SIZE;
+    result.allocationsPerOp = -1;
+    result.bytesPerOp = -1;
+    result.p50Nanoseconds = -1;
+    result.p99Nanoseconds = -1;
+#ifdef SHOP_BENCH
+    long long allocationsBefore = threadAllocations;
+    long long bytesBefore = threadAllocatedBytes;
+#endif
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < SIZE; i++) {
+        lines.clear();
+        long long total = 0;
+        for (int l = 0; l < LINES; l++) {
+            ProductHandle product = products[workload.rng() % products.size()];
+            Product* current = product.get();
+            long long unitCents = current->getPriceCents();
+            lines.push_back(OrderLine{product, 1 + l, unitCents, unitCents * (1 + l), current->getName()});
+            total += unitCents * (1 + l);
+        }
+        orders.push(Order(i + 1, lines, total, 1700000000LL + i));
     }
-};
+    result.nanosecondsPerOp = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / SIZE;
+#ifdef SHOP_BENCH
+    result.allocationsPerOp = (threadAllocations - allocationsBefore) / (double)SIZE;
+    result.bytesPerOp = (threadAllocatedBytes - bytesBefore) / (double)SIZE;
+#endif
+    if (retain) results.push_back(result);
 
-// --------------------- CartAction ---------------------
-struct CartAction {
-    string actionType; // "add" or "remove"
-    Product* product;
-    int quantity;
+    if (view) {
+        NullBuffer discard;
+        ostream quiet(&discard);
+        results.push_back(runLatencyBenchmark("orders_view_10m", workload.config.minSeconds, [&] {
+            OutputBuffer out(quiet);
+            renderOrders(out, orders, RENDER_TEXT);
+        }));
+    }
+}
 
-    CartAction() {
-        actionType = "";
-        product = nullptr;
-        quantity = 0;
+// Group commit in the journal's write-ahead log: one op appends a
+// cart-line-sized record and calls commit(), timed on its own so p99 shows the
+// fsync that every groupSize-th commit pays (or the 5 ms background flush).
+void runJournalBenchmarks(BenchWorkload& workload, vector<BenchResult>& results) {
+    const int GROUP_SIZES[3] = {1, 64, 1024};
+    for (int g = 0; g < 3; g++) {
+        string name = "wal_commit_group" + to_string(GROUP_SIZES[g]);
+        if (!workload.config.selects(name)) continue;
+        WriteAheadLog wal;
+        ::remove(BENCH_JOURNAL_PATH);
+        wal.open(BENCH_JOURNAL_PATH, 1, GROUP_SIZES[g], chrono::milliseconds(5));
+        ByteWriter payload;
+        payload.putString("user123@example.com");
+        payload.putInt32(4711);
+        payload.putInt32(2);
+        results.push_back(runLatencyBenchmark(name, workload.config.minSeconds, [&] {
+            wal.append(JOURNAL_CART_LINE, payload);
+            wal.commit();
+        }));
+        wal.close();
+        ::remove(BENCH_JOURNAL_PATH);
     }
+}
 
-    CartAction(string type, Product* productItem, int quantityItem)
-        : actionType(type), product(productItem), quantity(quantityItem) {}
-};
+vector<BenchResult> runBenchmarks(BenchWorkload& workload) {
+    vector<pair<string, function<void(long long)>>> suite;
+    mt19937_64& rng = workload.rng;
 
-// --------------------- Cart Class ---------------------
-class Cart {
-private:
-    MyLinkedList cartItems;
-    MyStack<CartAction> undoStack;
+    suite.push_back(make_pair("stack_push_pop", [](long long n) {
+        MyStack<int> stack;
+        for (long long i = 0; i < n; i++) stack.push((int)i);
+        for (long long i = 0; i < n; i++) stack.pop();
+    }));
+    suite.push_back(make_pair("queue_push_pop", [](long long n) {
+        MyQueue<int> queue;
+        for (long long i = 0; i < n; i++) queue.push((int)i);
+        for (long long i = 0; i < n; i++) queue.pop();
+    }));
+    // The same work on the standard containers, and with a heap-allocated string
+    // payload that has to be moved rather than copied.
+    suite.push_back(make_pair("std_vector_push_pop", [](long long n) {
+        vector<int> stack;
+        for (long long i = 0; i < n; i++) stack.push_back((int)i);
+        for (long long i = 0; i < n; i++) stack.pop_back();
+    }));
+    suite.push_back(make_pair("std_deque_push_pop", [](long long n) {
+        deque<int> queue;
+        for (long long i = 0; i < n; i++) queue.push_back((int)i);
+        for (long long i = 0; i < n; i++) queue.pop_front();
+    }));
+    suite.push_back(make_pair("queue_push_pop_string", [](long long n) {
+        MyQueue<string> queue;
+        for (long long i = 0; i < n; i++) queue.push(string(32, 'x'));
+        for (long long i = 0; i < n; i++) {
+            benchSink = (long long)queue.front().size();
+            queue.pop();
+        }
+    }));
+    suite.push_back(make_pair("std_deque_push_pop_string", [](long long n) {
+        deque<string> queue;
+        for (long long i = 0; i < n; i++) queue.push_back(string(32, 'x'));
+        for (long long i = 0; i < n; i++) {
+            benchSink = (long long)queue.front().size();
+            queue.pop_front();
+        }
+    }));
+    suite.push_back(make_pair("list_add_remove", [&workload](long long n) {
+        MyLinkedList items;
+        for (long long i = 0; i < n; i++) {
+            ProductHandle product = workload.popularProduct();
+            items.add(product, 1);
+            if (items.size() > workload.config.cartSize * 4) items.remove(items.getHead()->product, 1 << 30);
+        }
+    }));
+    suite.push_back(make_pair("catalog_find", [&workload, &rng](long long n) {
+        long long found = 0;
+        for (long long i = 0; i < n; i++) found += workload.catalog.find(workload.popularity.next(rng)).get() != NULL;
+        benchSink = found;
+    }));
+    suite.push_back(make_pair("cart_add", [&workload, &rng](long long n) {
+        Cart cart;
+        for (long long i = 0; i < n; i++) {
+            if (cart.getItems().size() >= workload.config.cartSize * 4) cart.clear();
+            cart.addToCart(workload.popularProduct(), 1 + (int)(rng() % 3));
+        }
+    }));
+    suite.push_back(make_pair("cart_add_undo", [&workload](long long n) {
+        Cart cart;
+        for (long long i = 0; i < n; i++) {
+            cart.addToCart(workload.popularProduct(), 1);
+            cart.undoLastAction();
+        }
+    }));
+    suite.push_back(make_pair("order_create", [&workload](long long n) {
+        MyLinkedList items;
+        MyQueue<Order> orders;
+        for (long long i = 0; i < n; i++) {
+            items.clear();
+            workload.fillCart(items);
+            orders.push(Order((int)i, items));
+        }
+    }));
+    suite.push_back(make_pair("checkout_reserve", [&workload](long long n) {
+        MyLinkedList items;
+        for (long long i = 0; i < n; i++) {
+            items.clear();
+            workload.fillCart(items);
+            StockReservation reservation(items);
+            Order order((int)i, items);
+            // Leaving the reservation uncommitted puts the stock back.
+        }
+    }));
+    // The pricing cases price the same pre-generated carts; one op is one cart.
+    const int PRICING_BATCH = 256;
+    PricingRules pricingRules;
+    workload.buildPricingRules(pricingRules);
+    vector<PricingRuleSpec> interpretedRules = flattenPricingRules(pricingRules);
+    vector<PricedLine> pricedLines;
+    vector<int> cartStarts;
+    vector<PriceBreakdown> breakdowns(PRICING_BATCH);
+    workload.fillPricedCarts(PRICING_BATCH, pricedLines, cartStarts);
 
-public:
-    void addToCart(Product* product, int quantityToAdd) {
-        if (quantityToAdd > product->getStock()) {
-            cout << "Not enough stock. Available: " << product->getStock() << endl;
-            return;
+    suite.push_back(make_pair("pricing_pipeline_batch", [&](long long n) {
+        long long total = 0;
+        for (long long done = 0; done < n; done += PRICING_BATCH) {
+            int count = (int)min((long long)PRICING_BATCH, n - done);
+            StandardPricing::priceBatch(pricingRules, pricedLines.data(), cartStarts.data(), count, breakdowns.data());
+            for (int c = 0; c < count; c++) total += breakdowns[c].totalCents;
+        }
+        benchSink = total;
+    }));
+    suite.push_back(make_pair("pricing_pipeline_cart", [&](long long n) {
+        long long total = 0;
+        for (long long done = 0; done < n; done++) {
+            int c = (int)(done % PRICING_BATCH);
+            total += StandardPricing::price(pricingRules, &pricedLines[cartStarts[c]], cartStarts[c + 1] - cartStarts[c]).totalCents;
+        }
+        benchSink = total;
+    }));
+    suite.push_back(make_pair("pricing_interpreted", [&](long long n) {
+        long long total = 0;
+        for (long long done = 0; done < n; done++) {
+            int c = (int)(done % PRICING_BATCH);
+            total += priceInterpreted(interpretedRules, &pricedLines[cartStarts[c]], cartStarts[c + 1] - cartStarts[c]).totalCents;
+        }
+        benchSink = total;
+    }));
+    // One op is one item through a 1024-slot queue shared by P producer and P
+    // consumer threads (thread start-up included).
+    const int QUEUE_THREADS[3] = {1, 4, 16};
+    for (int t = 0; t < 3; t++) {
+        int threads = QUEUE_THREADS[t];
+        string shape = to_string(threads) + "x" + to_string(threads);
+        suite.push_back(make_pair("mpmc_ring_" + shape, [threads](long long n) {
+            MyConcurrentQueue<long long> queue(1024);
+            transferThroughQueue(queue, n, threads, threads);
+        }));
+        suite.push_back(make_pair("mpmc_mutex_" + shape, [threads](long long n) {
+            LockedQueue queue(1024);
+            transferThroughQueue(queue, n, threads, threads);
+        }));
+    }
+    // Startup from the workload's catalog written as catalog.bin: one op is one
+    // open + load into a fresh catalog, teardown included. The cold case drops the
+    // file from the page cache before each load.
+    CatalogFile::write(workload.catalog, BENCH_CATALOG_PATH);
+    for (int cold = 0; cold < 2; cold++) {
+        suite.push_back(make_pair(cold ? "catalog_load_cold" : "catalog_load_warm", [cold](long long n) {
+            for (long long i = 0; i < n; i++) {
+                if (cold) evictFileCache(BENCH_CATALOG_PATH);
+                CatalogFile* file = new CatalogFile();
+                if (!file->open(BENCH_CATALOG_PATH)) {
+                    delete file;
+                    continue;
+                }
+                Catalog loaded;
+                benchSink = CatalogFile::loadInto(file, loaded);
+            }
+        }));
+    }
+    // The text baseline: the same catalog exported as CSV and parsed back by
+    // importCatalogCsv, warm cache.
+    {
+        ofstream csv(BENCH_CSV_PATH);
+        OutputBuffer out(csv);
+        workload.catalog.render(out, RENDER_CSV);
+    }
+    suite.push_back(make_pair("catalog_load_csv", [](long long n) {
+        for (long long i = 0; i < n; i++) {
+            Catalog loaded;
+            benchSink = importCatalogCsv(BENCH_CSV_PATH, loaded) + loaded.size();
+        }
+    }));
+    suite.push_back(make_pair("user_lookup", [&workload, &rng](long long n) {
+        long long unique = 0;
+        for (long long i = 0; i < n; i++) unique += workload.users.isEmailUnique(workload.emails[rng() % workload.emails.size()]);
+        benchSink = unique;
+    }));
+    suite.push_back(make_pair("user_login", [&workload, &rng](long long n) {
+        for (long long i = 0; i < n; i++) {
+            size_t user = rng() % workload.emails.size();
+            benchSink = workload.users.login(workload.emails[user], "password" + to_string(user)) != NULL;
         }
-        CartItem* newItem = new CartItem(product, quantityToAdd);
-        cartItems.add(newItem);
-        undoStack.push(CartAction("add", product, quantityToAdd));
-        cout << "Added " << product->getName() << " x" << quantityToAdd << " to cart." << endl;
+    }));
+
+    NullBuffer discard;
+    streambuf* console = cout.rdbuf(&discard);
+    workload.catalog.getSearchIndex();
+    vector<BenchResult> results;
+    for (size_t i = 0; i < suite.size(); i++) {
+        if (!workload.config.selects(suite[i].first)) continue;
+        rng.seed(workload.config.seed + i);
+        results.push_back(runBenchmark(suite[i].first, workload.config.minSeconds, suite[i].second));
+    }
+    const char* checkoutCases[2] = {"checkout_sync", "checkout_pipeline"};
+    for (int i = 0; i < 2; i++) {
+        if (!workload.config.selects(checkoutCases[i])) continue;
+        rng.seed(workload.config.seed + suite.size() + i);
+        results.push_back(runCheckoutBenchmark(checkoutCases[i], workload, i == 1));
     }
+    runSessionBenchmarks(workload, results);
+    runCatalogScaleBenchmarks(workload, results);
+    runCatalogBuildBenchmarks(workload, results);
+    runStockContentionBenchmarks(workload, results);
+    runUserScaleBenchmarks(workload, results);
+    runProductQueryBenchmarks(workload, results);
+    runSearchBenchmarks(workload, results);
+    runCartTotalBenchmarks(workload, results);
+    runCheckoutAllocationBenchmarks(workload, results);
+    runAnalyticsBenchmarks(workload, results);
+    runJournalBenchmarks(workload, results);
+    runOrderHistoryBenchmarks(workload, results);
+    runCatalogRenderBenchmarks(workload, results);
+    ::remove(BENCH_CATALOG_PATH);
+    ::remove(BENCH_CSV_PATH);
+    cout.rdbuf(console);
+    return results;
+}
 
-    void removeFromCart(Product* product, int quantityToRemove) {
-        undoStack.push(CartAction("remove", product, quantityToRemove));
-        cartItems.remove(product->getId(), quantityToRemove);
-        cout << "Removed " << product->getName() << " x" << quantityToRemove << " from cart." << endl;
+void renderBenchResults(OutputBuffer& out, BenchConfig& config, vector<BenchResult>& results) {
+    char number[32];
+    if (config.format == RENDER_JSON) {
+        out.put("{\"seed\":").put((long long)config.seed).put(",\"products\":").put(config.products)
+           .put(",\"users\":").put(config.users);
+        snprintf(number, sizeof(number), "%.3f", config.zipfExponent);
+        out.put(",\"zipf\":").put(number).put(",\"cartSize\":").put(config.cartSize).put(",\"results\":[");
+    } else if (config.format == RENDER_CSV) {
+        out.put("name,operations,ns_per_op,allocs_per_op,bytes_per_op,p50_ns,p99_ns\n");
+    } else {
+        out.put("benchmark              operations      ns/op  allocs/op   bytes/op     p50 ns     p99 ns\n");
     }
 
-    void undoLastAction() {
-        if (undoStack.isEmpty()) {
-            cout << "Nothing to undo." << endl;
-            return;
+    for (size_t i = 0; i < results.size(); i++) {
+        BenchResult& result = results[i];
+        if (config.format == RENDER_TEXT) {
+            char row[160];
+            int length = snprintf(row, sizeof(row), "%-20s %12lld %10.1f %10.3f %10.1f", result.name.c_str(),
+                                  result.operations, result.nanosecondsPerOp, result.allocationsPerOp, result.bytesPerOp);
+            if (result.p50Nanoseconds >= 0) {
+                snprintf(row + length, sizeof(row) - length, " %10.0f %10.0f", result.p50Nanoseconds, result.p99Nanoseconds);
+            }
+            out.put(row).put('\n');
+            continue;
         }
-        CartAction lastAction = undoStack.top();
-        undoStack.pop();
+        bool json = config.format == RENDER_JSON;
+        if (json) out.put(i > 0 ? ",{\"name\":" : "{\"name\":").putJsonString(result.name).put(",\"operations\":");
+        else out.put(result.name).put(',');
+        out.put(result.operations);
+        snprintf(number, sizeof(number), "%.2f", result.nanosecondsPerOp);
+        out.put(json ? ",\"nsPerOp\":" : ",").put(number);
+        snprintf(number, sizeof(number), "%.4f", result.allocationsPerOp);
+        out.put(json ? ",\"allocsPerOp\":" : ",").put(number);
+        snprintf(number, sizeof(number), "%.1f", result.bytesPerOp);
+        out.put(json ? ",\"bytesPerOp\":" : ",").put(number);
+        if (result.p50Nanoseconds >= 0) {
+            snprintf(number, sizeof(number), "%.0f", result.p50Nanoseconds);
+            out.put(json ? ",\"p50Ns\":" : ",").put(number);
+            snprintf(number, sizeof(number), "%.0f", result.p99Nanoseconds);
+            out.put(json ? ",\"p99Ns\":" : ",").put(number);
+        } else if (!json) {
+            out.put(",,");
+        }
+        out.put(json ? "}" : "\n");
+    }
+    if (config.format == RENDER_JSON) out.put("]}\n");
+}
 
-        if (lastAction.actionType == "add") {
-            cartItems.remove(lastAction.product->getId(), lastAction.quantity);
-        } else if (lastAction.actionType == "remove") {
-            cartItems.add(new CartItem(lastAction.product, lastAction.quantity));
+// --bench [--seed N] [--products N] [--users N] [--zipf S] [--cart-size N]
+//         [--cart-dist fixed|uniform|geometric] [--min-time SECONDS]
+//         [--format json|csv|text] [--filter NAME]
+// --filter runs only the cases whose name contains NAME; the fixed-size scale
+// cases (e.g. catalog_scan_1m) are skipped unless a filter selects them.
+// Allocations per operation are only counted in a -DSHOP_BENCH build.
+int runBenchCommand(int argc, char* argv[]) {
+    BenchConfig config;
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+        if (i + 1 >= argc) {
+            cout << "Missing value for " << option << '\n';
+            return 1;
+        }
+        string value = argv[++i];
+        try {
+            if (option == "--seed") config.seed = stoull(value);
+            else if (option == "--products") config.products = max(1, stoi(value));
+            else if (option == "--users") config.users = max(1, stoi(value));
+            else if (option == "--zipf") config.zipfExponent = max(0.0, stod(value));
+            else if (option == "--cart-size") config.cartSize = max(1, stoi(value));
+            else if (option == "--min-time") config.minSeconds = stod(value);
+            else if (option == "--filter") config.filter = value;
+            else if (option == "--cart-dist") {
+                if (value == "fixed") config.cartSizes = CART_SIZE_FIXED;
+                else if (value == "uniform") config.cartSizes = CART_SIZE_UNIFORM;
+                else if (value == "geometric") config.cartSizes = CART_SIZE_GEOMETRIC;
+                else throw invalid_argument("cart-dist");
+            } else if (option == "--format") {
+                if (value == "json") config.format = RENDER_JSON;
+                else if (value == "csv") config.format = RENDER_CSV;
+                else if (value == "text") config.format = RENDER_TEXT;
+                else throw invalid_argument("format");
+            } else {
+                cout << "Unknown option " << option << '\n';
+                return 1;
+            }
+        } catch (const exception&) {
+            cout << "Bad value for " << option << ": " << value << '\n';
+            return 1;
         }
+    }
+
+    BenchWorkload workload(config);
+    vector<BenchResult> results = runBenchmarks(workload);
+    OutputBuffer out(cout);
+    renderBenchResults(out, config, results);
+    return 0;
+}
+
+// --------------------- Self Test ---------------------
+// --selftest [NAME] runs the built-in checks (those whose name contains NAME),
+// printing one line per check. Returns the number of checks that failed.
 
-        cout << "Undo action performed." << endl;
+// 16 producers and 16 consumers through a 64-slot ring, so it is full and empty
+// often. Every item must arrive exactly once, and each consumer must see any one
+// producer's items in the order they were pushed. Lost items show up as a stall,
+// which fails the check once the deadline passes.
+bool testConcurrentQueueStress() {
+    const int PRODUCERS = 16, CONSUMERS = 16, ITEMS_PER_PRODUCER = 20000;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::seconds(30);
+    MyConcurrentQueue<long long> queue(64);
+    vector<atomic<unsigned char>> seen(PRODUCERS * ITEMS_PER_PRODUCER);
+    for (size_t i = 0; i < seen.size(); i++) seen[i].store(0, memory_order_relaxed);
+    atomic<long long> consumed{0};
+    atomic<bool> ordered{true};
+
+    vector<thread> threads;
+    for (int p = 0; p < PRODUCERS; p++) {
+        threads.emplace_back([&queue, p, deadline] {
+            for (int i = 0; i < ITEMS_PER_PRODUCER; i++) {
+                while (!queue.tryPush(((long long)p << 32) | i)) {
+                    if (chrono::steady_clock::now() > deadline) return;
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < CONSUMERS; c++) {
+        threads.emplace_back([&, c] {
+            vector<int> last(PRODUCERS, -1);
+            long long batch[8];
+            mt19937 rng(c);
+            while (consumed.load(memory_order_relaxed) < (long long)seen.size()) {
+                int count = queue.popBatch(batch, 1 + (int)(rng() % 8));
+                if (count == 0) {
+                    if (chrono::steady_clock::now() > deadline) return;
+                    this_thread::yield();
+                    continue;
+                }
+                for (int i = 0; i < count; i++) {
+                    int producer = (int)(batch[i] >> 32), item = (int)(batch[i] & 0xffffffff);
+                    if (item <= last[producer]) ordered = false;
+                    last[producer] = item;
+                    seen[producer * ITEMS_PER_PRODUCER + item].fetch_add(1, memory_order_relaxed);
+                }
+                consumed.fetch_add(count, memory_order_relaxed);
+            }
+        });
     }
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
 
-    void displayCart() { cartItems.display(); }
-    MyLinkedList& getItems() { return cartItems; }
-    void clear() { cartItems.clear(); }
-};
+    for (size_t i = 0; i < seen.size(); i++) {
+        if (seen[i].load(memory_order_relaxed) != 1) return false;
+    }
+    return ordered && consumed == (long long)seen.size();
+}
 
-// --------------------- Order Class ---------------------
-class Order {
+// Pushing an element of a full container back onto it (push(top()),
+// push(front()), emplace from one) must copy it before the buffer is
+// reallocated. Build with -fsanitize=address to catch a read of the freed buffer.
+bool testContainerSelfPush() {
+    const string VALUE(40, 'x');
+    MyStack<string> stack(1);
+    MyQueue<string> queue(1);
+    stack.push(VALUE);
+    queue.push(VALUE);
+    bool passed = true;
+    for (int i = 0; i < 6; i++) {
+        stack.push(stack.top());
+        // Moving the top onto itself leaves the old slot moved-from; restore it.
+        stack.push(std::move(stack.top()));
+        passed = passed && stack.top() == VALUE;
+        stack.pop();
+        stack.top() = VALUE;
+        stack.emplace(stack.top());
+        queue.push(queue.front());
+        queue.emplace(queue.at(queue.size() - 1));
+    }
+    passed = passed && stack.size() == 13 && queue.size() == 13;
+    while (!stack.isEmpty()) {
+        passed = passed && stack.top() == VALUE;
+        stack.pop();
+    }
+    while (!queue.isEmpty()) {
+        passed = passed && queue.front() == VALUE;
+        queue.pop();
+    }
+    return passed;
+}
+
+// A two-product store behind a BatchRunner, journaling to selftest.wal. run()
+// executes batch commands with their output discarded and returns the failures.
+class SelfTestStore {
 private:
-    int orderId;
-    MyLinkedList items;
-    double totalPrice;
+    static constexpr const char* JOURNAL = "selftest.wal";
 
 public:
-    Order() {
-        orderId = 0;
-        totalPrice = 0.0;
+    Catalog catalog;
+    SessionManager sessions;
+    MyQueue<Order> orders;
+    int orderCounter;
+    StoreJournal journal;
+    SalesRollup rollup;
+    PricingEngine pricing;
+    UserDirectory users;
+    CheckoutPipeline checkout;
+    BatchRunner runner;
+    bool opened;
+
+    SelfTestStore()
+        : orderCounter(1), rollup(catalog), pricing(catalog),
+          checkout(catalog, orders, orderCounter, journal, rollup, pricing),
+          runner(catalog, sessions, orders, orderCounter, journal, users, pricing, checkout) {
+        catalog.add(Product(101, "Laptop", "Electronics", 100000, 50));
+        catalog.add(Product(102, "Phone", "Electronics", 50000, 50));
+        opened = journal.openEmpty(JOURNAL);
     }
 
-    Order(int newOrderId, MyLinkedList& cartItems) {
-        orderId = newOrderId;
-        totalPrice = 0.0;
+    ~SelfTestStore() { ::remove(JOURNAL); }
 
-        CartItem* temp = cartItems.getHead();
-        while (temp != NULL) {
-            items.add(new CartItem(temp->product, temp->quantity));
-            totalPrice += temp->product->getPrice() * temp->quantity;
-            temp = temp->next;
-        }
+    int run(const string& commands) {
+        NullBuffer discard;
+        streambuf* console = cout.rdbuf(&discard);
+        istringstream in(commands);
+        int failed = runner.execute(in);
+        cout.rdbuf(console);
+        return opened ? failed : failed + 1;
     }
 
-    void display() {
-        cout << "Order ID: " << orderId << " Total: $" << totalPrice << endl;
-        CartItem* temp = items.getHead();
-        while (temp != NULL) {
-            cout << " - " << temp->product->getName()
-                 << " x" << temp->quantity
-                 << " - $" << temp->product->getPrice() << endl;
-            temp = temp->next;
-        }
+    int quantityIn(const string& email, int productId) {
+        return sessions.open(email).cart.getItems().quantityOf(catalog.find(productId));
     }
 };
 
-// --------------------- Helper Function ---------------------
-bool isEmailUnique(vector<User>& users, string emailToCheck) {
-    for (int i = 0; i < users.size(); i++) {
-        if (users[i].getEmail() == emailToCheck) return false;
+// A batch where begin/commit wrap an add, a second add and a remove after an
+// earlier add of the same product: undo must take back exactly the three
+// grouped changes and redo must put all three back.
+bool testBatchTransaction() {
+    SelfTestStore store;
+    const string EMAIL = "t@example.com";
+    bool passed = store.run("register Tess t@example.com pw\nlogin t@example.com pw\nadd 101 1\n"
+                            "begin\nadd 101 2\nadd 102 1\nremove 101 1\ncommit\nundo\n") == 0
+        && store.quantityIn(EMAIL, 101) == 1 && store.quantityIn(EMAIL, 102) == 0;
+    return passed && store.run("redo\n") == 0 && store.quantityIn(EMAIL, 101) == 2 && store.quantityIn(EMAIL, 102) == 1;
+}
+
+// Checkout starts a fresh undo history: redo after a checkout must not bring a
+// purchased line back, and a begin left open before it must not group later
+// changes.
+bool testCheckoutClearsUndo() {
+    SelfTestStore store;
+    if (store.run("register Tess t@example.com pw\nlogin t@example.com pw\nbegin\nadd 101 1\ncheckout\n"
+                  "add 102 1\nundo\nredo\ncheckout\nadd 101 1\ncheckout\nundo\nredo\n") != 0) {
+        return false;
     }
-    return true;
+    if (store.orders.size() != 3 || store.quantityIn("t@example.com", 101) != 0) return false;
+    Order& second = store.orders.at(1);
+    return second.getLineCount() == 1 && second.getLines()[0].product == store.catalog.find(102);
 }
 
-// --------------------- Safe Input Functions ---------------------
-int getIntInput(const string& prompt) {
-    int value;
-    while (true) {
-        cout << prompt;
-        if (cin >> value) {
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            return value;
-        } else {
-            cout << "Invalid input, please enter a number." << endl;
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        }
+// A journaled checkout of a product the catalog no longer has (e.g. the store
+// fell back to the seeded catalog) must replay as an order with the line kept
+// by name, without touching stock.
+bool testReplayCheckoutOfMissingProduct() {
+    const string PREFIX = "selftest-";
+    const string FILES[3] = {PREFIX + CATALOG_PATH, PREFIX + STORE_SNAPSHOT_PATH, PREFIX + JOURNAL_PATH};
+    for (int i = 0; i < 3; i++) ::remove(FILES[i].c_str());
+
+    bool logged;
+    {
+        Catalog catalog;
+        catalog.add(Product(500, "Lamp", "Home", 2500, 10));
+        SessionManager sessions;
+        MyQueue<Order> orders;
+        int orderCounter = 1;
+        StoreJournal journal(PREFIX);
+        MyLinkedList items;
+        items.add(catalog.find(500), 2);
+        Order order(1, items);
+        logged = journal.recover(catalog, sessions, orders, orderCounter) && journal.logCheckout("t@example.com", order);
+    }
+
+    Catalog catalog;
+    catalog.add(Product(101, "Laptop", "Electronics", 100000, 5));
+    SessionManager sessions;
+    MyQueue<Order> orders;
+    int orderCounter = 1;
+    bool passed;
+    {
+        StoreJournal journal(PREFIX);
+        passed = logged && journal.recover(catalog, sessions, orders, orderCounter) && orders.size() == 1
+            && orders.at(0).getLineCount() == 1 && orders.at(0).getLines()[0].name == "Lamp"
+            && orders.at(0).getLines()[0].product.get() == NULL && catalog.find(101).get()->getStock() == 5
+            && orderCounter == 2;
     }
+    for (int i = 0; i < 3; i++) ::remove(FILES[i].c_str());
+    return passed;
 }
 
-double getDoubleInput(const string& prompt) {
-    double value;
-    while (true) {
-        cout << prompt;
-        if (cin >> value) {
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            return value;
-        } else {
-            cout << "Invalid input, please enter a number." << endl;
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        }
+int runSelfTestCommand(int argc, char* argv[]) {
+    vector<pair<string, function<bool()>>> checks;
+    checks.push_back(make_pair("concurrent_queue_stress", testConcurrentQueueStress));
+    checks.push_back(make_pair("container_self_push", testContainerSelfPush));
+    checks.push_back(make_pair("batch_transaction", testBatchTransaction));
+    checks.push_back(make_pair("checkout_clears_undo", testCheckoutClearsUndo));
+    checks.push_back(make_pair("replay_checkout_missing_product", testReplayCheckoutOfMissingProduct));
+
+    string filter = argc >= 3 ? argv[2] : "";
+    int failed = 0;
+    for (size_t i = 0; i < checks.size(); i++) {
+        if (!filter.empty() && checks[i].first.find(filter) == string::npos) continue;
+        bool passed = checks[i].second();
+        if (!passed) failed++;
+        cout << (passed ? "ok   " : "FAIL ") << checks[i].first << '\n';
     }
+    return failed;
 }
 
 // --------------------- Main Program ---------------------
-int main() {
-    vector<Product> products;
-    products.push_back(Product(101, "Laptop", "Electronics", 1000, 5));
-    products.push_back(Product(102, "Phone", "Electronics", 500, 10));
-    products.push_back(Product(103, "Shoes", "Clothing", 80, 20));
-    products.push_back(Product(104, "Bags", "Assessories", 1700, 6));
-
-    vector<User> users;
-    users.push_back(User("Admin", "admin", "admin"));
+int main(int argc, char* argv[]) {
+    MetricClock::start();
+    if (argc >= 2 && string(argv[1]) == "--bench") return runBenchCommand(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--selftest") return runSelfTestCommand(argc, argv);
+    if (argc == 4 && string(argv[1]) == "--import-csv") {
+        Catalog imported;
+        int skipped = importCatalogCsv(argv[2], imported);
+        if (skipped < 0) {
+            cout << "Cannot read " << argv[2] << '\n';
+            return 1;
+        }
+        if (!CatalogFile::write(imported, argv[3])) {
+            cout << "Cannot write " << argv[3] << '\n';
+            return 1;
+        }
+        cout << "Imported " << imported.size() << " products (" << skipped << " lines skipped).\n";
+        return 0;
+    }
 
-    Cart cart;
+    Catalog catalog;
+    SessionManager sessions;
     MyQueue<Order> orders;
     int orderCounter = 1;
 
+    StoreJournal journal;
+    if (!journal.loadCatalog(catalog)) {
+        catalog.add(Product(101, "Laptop", "Electronics", 100000, 5));
+        catalog.add(Product(102, "Phone", "Electronics", 50000, 10));
+        catalog.add(Product(103, "Shoes", "Clothing", 8000, 20));
+        catalog.add(Product(104, "Bags", "Assessories", 170000, 6));
+    }
+    if (!journal.recover(catalog, sessions, orders, orderCounter)) {
+        cout << "Cannot open " << JOURNAL_PATH << " for writing; changes will not survive a restart.\n";
+    }
+    SalesRollup rollup(catalog);
+    rollup.rebuild(orders);
+
+    // --export products|orders text|json|csv writes the current store to stdout.
+    if (argc == 4 && string(argv[1]) == "--export") {
+        string what = argv[2], formatName = argv[3];
+        RenderFormat format = RENDER_TEXT;
+        if (formatName == "json") format = RENDER_JSON;
+        else if (formatName == "csv") format = RENDER_CSV;
+        else if (formatName != "text") {
+            cout << "Unknown format " << formatName << '\n';
+            return 1;
+        }
+        OutputBuffer out(cout);
+        if (what == "products") catalog.render(out, format);
+        else if (what == "orders") renderOrders(out, orders, format);
+        else {
+            out.put("Unknown export ").put(what).put('\n');
+            return 1;
+        }
+        return 0;
+    }
+
+    PricingEngine pricing(catalog);
+    int badRuleLine = loadPricingRules(PRICING_RULES_PATH, catalog, pricing.getRules());
+    if (badRuleLine > 0) cout << "Ignoring " << PRICING_RULES_PATH << ": bad rule on line " << badRuleLine << '\n';
+
+    UserDirectory users;
+    users.registerUser("Admin", "admin", "admin");
+    CheckoutPipeline checkout(catalog, orders, orderCounter, journal, rollup, pricing);
+
+    // --batch [file] runs commands from the file (or stdin) instead of the menus.
+    if ((argc == 2 || argc == 3) && string(argv[1]) == "--batch") {
+        BatchRunner runner(catalog, sessions, orders, orderCounter, journal, users, pricing, checkout);
+        int failed;
+        if (argc == 3 && string(argv[2]) != "-") {
+            ifstream in(argv[2]);
+            if (!in) {
+                cout << "Cannot read " << argv[2] << '\n';
+                return 1;
+            }
+            failed = runner.execute(in);
+        } else {
+            failed = runner.execute(cin);
+        }
+        cout.flush();
+        runner.report(cerr);
+        if (!journal.snapshot(catalog, sessions, orders, orderCounter)) {
+            cout << "Could not save store snapshot.\n";
+            return 1;
+        }
+        return failed == 0 ? 0 : 2;
+    }
+
     int mainChoice = -1;
+    int exitCode = 0;
     while (mainChoice != 0) {
-        cout << "\n--- Welcome to MyShop ---" << endl;
+        if (journal.snapshotDue() && !journal.snapshot(catalog, sessions, orders, orderCounter)) {
+            cout << "Could not save store snapshot.\n";
+        }
+        cout << "\n--- Welcome to MyShop ---\n";
         cout << "1. Register\n2. Login\n0. Exit\n";
         mainChoice = getIntInput("Choice: ");
 
@@ -395,11 +6839,10 @@ int main() {
                 cout << "Enter Email: "; getline(cin, userEmail);
                 cout << "Enter Password: "; getline(cin, userPassword);
 
-                if (!isEmailUnique(users, userEmail)) {
-                    cout << "Email already registered." << endl;
+                if (users.registerUser(userName, userEmail, userPassword) == NULL) {
+                    cout << "Email already registered.\n";
                 } else {
-                    users.push_back(User(userName, userEmail, userPassword));
-                    cout << "Registration successful!" << endl;
+                    cout << "Registration successful!\n";
                 }
                 break;
             }
@@ -409,182 +6852,238 @@ int main() {
                 cout << "Enter Email: "; getline(cin, loginEmail);
                 cout << "Enter Password: "; getline(cin, loginPassword);
 
-                bool loginSuccess = false;
-                bool isAdmin = false;
-                User* currentUser = nullptr;
-
-                for (int i = 0; i < users.size(); i++) {
-                    if (users[i].login(loginEmail, loginPassword)) {
-                        loginSuccess = true;
-                        currentUser = &users[i];
-                        if (loginEmail == "admin") isAdmin = true;
-                        break;
-                    }
-                }
-
-                if (!loginSuccess) {
-                    cout << "Login failed." << endl;
+                User* currentUser = users.login(loginEmail, loginPassword);
+                if (currentUser == NULL) {
+                    cout << "Login failed.\n";
                     break;
                 }
 
-                cout << "Login successful!" << endl;
+                cout << "Login successful!\n";
+                bool isAdmin = currentUser->getEmail() == "admin";
 
                 // --------------------- Admin Menu ---------------------
                 if (isAdmin) {
                     int adminChoice = -1;
                     while (adminChoice != 0) {
-                        cout << "\n--- Admin Menu ---" << endl;
-                        cout << "1. Display Products\n2. Add Product\n3. Update Stock\n4. Remove Product\n5. View Orders\n0. Logout\n";
+                        cout << "\n--- Admin Menu ---\n";
+                        cout << "1. Display Products\n2. Add Product\n3. Update Stock\n4. Remove Product\n5. View Orders\n6. Update Price\n7. Sales Report\n8. Sales by Time Window\n9. Show Metrics\n10. Dump Metrics to Files\n0. Logout\n";
                         adminChoice = getIntInput("Choice: ");
 
                         switch (adminChoice) {
                             case 1:
-                                for (int i = 0; i < products.size(); i++) products[i].display();
+                                catalog.display();
                                 break;
 
                             case 2: {
                                 int pid = getIntInput("Enter Product ID: ");
                                 string name, category;
-                                double price = getDoubleInput("Enter Price: ");
+                                long long price = getMoneyInput("Enter Price: ");
                                 int stock = getIntInput("Enter Stock: ");
                                 cin.ignore();
                                 cout << "Enter Name: "; getline(cin, name);
                                 cout << "Enter Category: "; getline(cin, category);
-                                products.push_back(Product(pid, name, category, price, stock));
-                                cout << "Product added." << endl;
+                                Product* added = catalog.add(Product(pid, name, category, price, stock)).get();
+                                if (added != NULL) {
+                                    if (!journal.logProductAdded(*added)) reportJournalFailure();
+                                    cout << "Product added.\n";
+                                } else cout << "Product ID already exists.\n";
                                 break;
                             }
 
                             case 3: {
                                 int pid = getIntInput("Enter Product ID: ");
                                 int newStock = getIntInput("Enter new stock: ");
-                                bool found = false;
-                                for (int i = 0; i < products.size(); i++) {
-                                    if (products[i].getId() == pid) {
-                                        products[i].setStock(newStock);
-                                        found = true;
-                                        cout << "Stock updated." << endl;
-                                        break;
-                                    }
-                                }
-                                if (!found) cout << "Product not found." << endl;
+                                Product* product = catalog.find(pid).get();
+                                if (product != NULL) {
+                                    product->setStock(newStock);
+                                    if (!journal.logStockSet(pid, newStock)) reportJournalFailure();
+                                    cout << "Stock updated.\n";
+                                } else cout << "Product not found.\n";
                                 break;
                             }
 
                             case 4: {
                                 int pid = getIntInput("Enter Product ID: ");
-                                bool found = false;
-                                for (int i = 0; i < products.size(); i++) {
-                                    if (products[i].getId() == pid) {
-                                        products.erase(products.begin() + i);
-                                        found = true;
-                                        cout << "Product removed." << endl;
-                                        break;
-                                    }
-                                }
-                                if (!found) cout << "Product not found." << endl;
+                                if (catalog.remove(pid)) {
+                                    if (!journal.logProductRemoved(pid)) reportJournalFailure();
+                                    cout << "Product removed.\n";
+                                } else cout << "Product not found.\n";
                                 break;
                             }
 
                             case 5: {
-                                if (orders.isEmpty()) cout << "No orders yet." << endl;
+                                if (orders.isEmpty()) cout << "No orders yet.\n";
                                 else {
-                                    MyQueue<Order> tempQueue = orders;
-                                    while (!tempQueue.isEmpty()) {
-                                        tempQueue.front().display();
-                                        tempQueue.pop();
-                                    }
+                                    OutputBuffer out(cout);
+                                    renderOrders(out, orders, RENDER_TEXT);
+                                }
+                                break;
+                            }
+
+                            case 6: {
+                                int pid = getIntInput("Enter Product ID: ");
+                                long long newPrice = getMoneyInput("Enter new price: ");
+                                if (catalog.setPrice(pid, newPrice)) {
+                                    if (!journal.logPriceSet(pid, newPrice)) reportJournalFailure();
+                                    cout << "Price updated.\n";
+                                } else cout << "Product not found.\n";
+                                break;
+                            }
+
+                            case 7: {
+                                OutputBuffer out(cout);
+                                renderSalesReport(out, rollup.getTotals(), catalog, 10);
+                                break;
+                            }
+
+                            case 8: {
+                                int minutes = getIntInput("Window length in minutes: ");
+                                if (minutes <= 0) {
+                                    cout << "Invalid window.\n";
+                                    break;
+                                }
+                                SalesTotals totals = analyzeOrders(orders, catalog, minutes * 60LL);
+                                OutputBuffer out(cout);
+                                renderSalesReport(out, totals, catalog, 10);
+                                break;
+                            }
+
+                            case 9: {
+                                OutputBuffer out(cout);
+                                renderMetrics(out, RENDER_TEXT);
+                                break;
+                            }
+
+                            case 10: {
+                                ofstream prometheus(METRICS_PROMETHEUS_PATH), json(METRICS_JSON_PATH);
+                                if (!prometheus || !json) {
+                                    cout << "Cannot write metrics files.\n";
+                                    break;
+                                }
+                                {
+                                    OutputBuffer out(prometheus);
+                                    renderMetricsPrometheus(out);
                                 }
+                                {
+                                    OutputBuffer out(json);
+                                    renderMetrics(out, RENDER_JSON);
+                                }
+                                cout << "Metrics written to " << METRICS_PROMETHEUS_PATH << " and " << METRICS_JSON_PATH << ".\n";
                                 break;
                             }
 
-                            case 0: cout << "Admin logged out." << endl; break;
-                            default: cout << "Invalid choice." << endl; break;
+                            case 0: cout << "Admin logged out.\n"; break;
+                            default: cout << "Invalid choice.\n"; break;
                         }
                     }
                 } 
                 // --------------------- User Menu ---------------------
                 else {
+                    string email = currentUser->getEmail();
+                    Cart& cart = sessions.open(email).cart;
+                    cart.setLineListener([&journal, email](ProductHandle product, int quantity) {
+                        if (!journal.logCartLine(email, product, quantity)) reportJournalFailure();
+                    });
                     int userChoice = -1;
                     while (userChoice != 0) {
-                        cout << "\n--- User Menu ---" << endl;
-                        cout << "1. Display Products\n2. Add to Cart\n3. Remove from Cart\n4. Undo\n5. View Cart\n6. Checkout\n7. View Orders\n0. Logout\n";
+                        cout << "\n--- User Menu ---\n";
+                        cout << "1. Display Products\n2. Add to Cart\n3. Remove from Cart\n4. Undo\n5. View Cart\n6. Checkout\n7. View Orders\n8. Filter Products\n9. Search Products\n10. Redo\n0. Logout\n";
                         userChoice = getIntInput("Choice: ");
 
                         switch (userChoice) {
                             case 1:
-                                for (int i = 0; i < products.size(); i++) products[i].display();
+                                catalog.display();
                                 break;
 
                             case 2: {
                                 int pid = getIntInput("Enter Product ID: ");
                                 int qty = getIntInput("Enter Quantity: ");
-                                bool found = false;
-                                for (int i = 0; i < products.size(); i++) {
-                                    if (products[i].getId() == pid) {
-                                        cart.addToCart(&products[i], qty);
-                                        found = true;
-                                        break;
-                                    }
-                                }
-                                if (!found) cout << "Product not found." << endl;
+                                ProductHandle product = catalog.find(pid);
+                                if (qty <= 0) cout << "Quantity must be positive.\n";
+                                else if (product.get() != NULL) cart.addToCart(product, qty);
+                                else cout << "Product not found.\n";
                                 break;
                             }
 
                             case 3: {
                                 int pid = getIntInput("Enter Product ID: ");
                                 int qty = getIntInput("Enter Quantity: ");
-                                bool found = false;
-                                for (int i = 0; i < products.size(); i++) {
-                                    if (products[i].getId() == pid) {
-                                        cart.removeFromCart(&products[i], qty);
-                                        found = true;
-                                        break;
-                                    }
-                                }
-                                if (!found) cout << "Product not found in cart." << endl;
+                                ProductHandle product = catalog.find(pid);
+                                if (qty <= 0) cout << "Quantity must be positive.\n";
+                                else if (product.get() != NULL) cart.removeFromCart(product, qty);
+                                else cout << "Product not found in cart.\n";
                                 break;
                             }
 
                             case 4: cart.undoLastAction(); break;
-                            case 5: cart.displayCart(); break;
+                            case 10: cart.redoLastAction(); break;
+                            case 5: {
+                                cart.displayCart();
+                                if (pricing.hasRules() && cart.getItems().size() > 0) {
+                                    PriceBreakdown breakdown = pricing.priceCart(cart.getItems());
+                                    OutputBuffer out(cout);
+                                    renderPriceBreakdown(out, breakdown);
+                                }
+                                break;
+                            }
 
                             case 6: {
-                                if (cart.getItems().getHead() == NULL) {
-                                    cout << "Cart empty." << endl;
-                                    break;
-                                }
-                                CartItem* tempItem = cart.getItems().getHead();
-                                while (tempItem != NULL) {
-                                    for (int i = 0; i < products.size(); i++) {
-                                        if (products[i].getId() == tempItem->product->getId()) {
-                                            products[i].setStock(products[i].getStock() - tempItem->quantity);
-                                            break;
-                                        }
-                                    }
-                                    tempItem = tempItem->next;
-                                }
-                                orders.push(Order(orderCounter, cart.getItems()));
-                                orderCounter++;
-                                cart.clear();
-                                cout << "Order placed successfully!" << endl;
+                                CheckoutResult result = checkout.submit(cart.getItems(), email).get();
+                                printCheckoutResult(result, pricing.hasRules());
+                                if (result.status == CHECKOUT_PLACED) cart.clear();
                                 break;
                             }
 
                             case 7: {
-                                if (orders.isEmpty()) cout << "No orders yet." << endl;
+                                if (orders.isEmpty()) cout << "No orders yet.\n";
                                 else {
-                                    MyQueue<Order> tempQueue = orders;
-                                    while (!tempQueue.isEmpty()) {
-                                        tempQueue.front().display();
-                                        tempQueue.pop();
+                                    OutputBuffer out(cout);
+                                    renderOrders(out, orders, RENDER_TEXT);
+                                }
+                                break;
+                            }
+
+                            case 8: {
+                                ProductQuery query;
+                                cout << "Category (blank for any): "; getline(cin, query.category);
+                                query.minPriceCents = getMoneyInput("Min Price: ");
+                                query.maxPriceCents = getMoneyInput("Max Price: ");
+                                query.inStockOnly = getIntInput("In stock only (1/0): ") == 1;
+                                query.limit = getIntInput("How many (0 for all): ");
+
+                                vector<Product*> results = queryProducts(catalog, query);
+                                if (results.empty()) cout << "No matching products.\n";
+                                OutputBuffer out(cout);
+                                for (int i = 0; i < (int)results.size(); i++) results[i]->render(out, RENDER_TEXT);
+                                break;
+                            }
+
+                            case 9: {
+                                string text;
+                                cout << "Search: "; getline(cin, text);
+                                ProductSearchIndex& index = catalog.getSearchIndex();
+                                vector<ProductHandle> results = index.search(text, 20);
+                                if (!results.empty()) {
+                                    OutputBuffer out(cout);
+                                    for (int i = 0; i < (int)results.size(); i++) results[i].get()->render(out, RENDER_TEXT);
+                                }
+
+                                if (results.empty()) {
+                                    cout << "No matching products.\n";
+                                    size_t lastWord = text.find_last_of(' ');
+                                    string prefix = lastWord == string::npos ? text : text.substr(lastWord + 1);
+                                    vector<string> suggestions = index.suggest(prefix, 5);
+                                    if (!prefix.empty() && !suggestions.empty()) {
+                                        cout << "Suggestions:";
+                                        for (int i = 0; i < (int)suggestions.size(); i++) cout << " " << suggestions[i];
+                                        cout << '\n';
                                     }
                                 }
                                 break;
                             }
 
-                            case 0: cout << "User logged out." << endl; break;
-                            default: cout << "Invalid choice." << endl; break;
+                            case 0: cout << "User logged out.\n"; break;
+                            default: cout << "Invalid choice.\n"; break;
                         }
                     }
                 }
@@ -592,10 +7091,16 @@ int main() {
                 break;
             }
 
-            case 0: cout << "Exiting program." << endl; break;
-            default: cout << "Invalid choice." << endl; break;
+            case 0:
+                if (!journal.snapshot(catalog, sessions, orders, orderCounter)) {
+                    cout << "Could not save store snapshot.\n";
+                    exitCode = 1;
+                }
+                cout << "Exiting program.\n";
+                break;
+            default: cout << "Invalid choice.\n"; break;
         }
     }
 
-    return 0;
+    return exitCode;
 }